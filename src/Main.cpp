@@ -1,288 +1,173 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 #include <cctype>
+#include <chrono>
+#include <csignal>
 #include <cstdint>
 #include <cstdlib>
-#include <fstream>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
 #include <sstream>
 #include <string>
-
-#include "lib/hash/sha1.hpp"
-#include "lib/http/HTTPRequest.hpp"
-#include "lib/nlohmann/json.hpp"
-
-using json = nlohmann::json;
-
-json decode_bencoded_string(const std::string& encoded_value, size_t& index) {
-	// Example: "5:hello" -> "hello"
-	size_t colon_index = encoded_value.find(':', index);
-	if (colon_index != std::string::npos) {
-		std::string number_string =
-			encoded_value.substr(index, colon_index - index);
-		int64_t number = std::atoll(number_string.c_str());
-		std::string str = encoded_value.substr(colon_index + 1, number);
-		index = colon_index + number + 1;
-		return json(str);
-	} else {
-		throw std::runtime_error("Invalid encoded value: " + encoded_value);
+#include <system_error>
+#include <thread>
+
+#include "announce_scheduler.hpp"
+#include "bencode.hpp"
+#include "disk_writer.hpp"
+#include "mock_tracker.hpp"
+#include "peer_cache.hpp"
+#include "peer_endpoint.hpp"
+#include "peer_engine.hpp"
+#include "resume_data.hpp"
+#include "storage.hpp"
+#include "torrent.hpp"
+#include "tracker.hpp"
+#include "util.hpp"
+
+// cached peers dialled on startup, before the tracker has answered
+constexpr size_t CACHED_PEER_DIALS = 8;
+// how often the resume data is brought up to date while pieces come in
+constexpr auto RESUME_SAVE_INTERVAL = std::chrono::seconds(10);
+
+// the download SIGINT and SIGTERM stop, so its progress can be saved
+PeerEngine* running_engine = nullptr;
+
+void stop_download(int) {
+	if (running_engine) {
+		running_engine->stop();
 	}
 }
 
-json decode_bencoded_integer(const std::string& encoded_value, size_t& index) {
-	size_t end_index = encoded_value.find('e', index + 1);
-	json decoded_value =
-		json(stoll(encoded_value.substr(index + 1, end_index - index - 1)));
-	index = end_index + 1;
-	return decoded_value;
-}
-
-json decode_bencoded_list(const std::string& encoded_value, size_t& index) {
-	std::vector<json> decoded_value;
-
-	index++;  // skip first 'l'
-	while (index < encoded_value.size() - 1) {
-		if (encoded_value[index] == 'e') {
-			// list ends
-			break;
-		}
-		if (std::isdigit(encoded_value[index])) {
-			decoded_value.push_back(
-				decode_bencoded_string(encoded_value, index));
-		} else if (encoded_value[index] == 'i') {
-			decoded_value.push_back(
-				decode_bencoded_integer(encoded_value, index));
-		} else if (encoded_value[index] == 'l') {
-			decoded_value.push_back(decode_bencoded_list(encoded_value, index));
+// Records handshakes and throughput in the cache and queues the best
+// cached peers for dialling
+void attach_peer_cache(PeerEngine& engine, PeerCache& peer_cache) {
+	engine.on_handshake = [&peer_cache](const PeerEndpoint& peer, bool ok) {
+		peer_cache.record_handshake(peer, ok);
+	};
+	engine.on_peer_closed = [&peer_cache](const PeerEndpoint& peer,
+										  std::uint32_t bytes_per_second) {
+		if (bytes_per_second > 0) {
+			peer_cache.record_throughput(peer, bytes_per_second);
 		}
-	}
-
-	index++;  // skip ending e
-	return json(decoded_value);
+	};
+	engine.add_peers(peer_cache.best_peers(CACHED_PEER_DIALS));
 }
 
-json decode_bencoded_dict(const std::string& encoded_value, size_t& index) {
-	json dict = json::object();
-
-	index++;  // skip leading 'd'
-	while (index < encoded_value.size() - 1) {
-		if (encoded_value[index] == 'e') {
-			// list ends
-			break;
-		}
-		json key = decode_bencoded_string(encoded_value, index);
-		json val;
-		if (std::isdigit(encoded_value[index])) {
-			val = decode_bencoded_string(encoded_value, index);
-		} else if (encoded_value[index] == 'i') {
-			val = decode_bencoded_integer(encoded_value, index);
-		} else if (encoded_value[index] == 'l') {
-			val = decode_bencoded_list(encoded_value, index);
-		} else if (encoded_value[index] == 'd') {
-			val = decode_bencoded_dict(encoded_value, index);
-		}
-
-		dict[key.get<std::string>()] = val;
+// A single-file torrent is written to output itself, the files of a
+// multi-file torrent go below output as a directory
+std::vector<StorageFile> storage_files(const TorrentLayout& layout,
+									   const std::string& output) {
+	if (!layout.multi_file) {
+		return {{output, layout.total_length}};
 	}
-
-	index++;  // skip ending 'e'
-	return dict;
-}
-
-json decode_bencoded_value(const std::string& encoded_value) {
-	size_t index = 0;
-	if (std::isdigit(encoded_value[0])) {
-		return decode_bencoded_string(encoded_value, index);
-	} else if (encoded_value[0] == 'i') {
-		return decode_bencoded_integer(encoded_value, index);
-	} else if (encoded_value[0] == 'l') {
-		return decode_bencoded_list(encoded_value, index);
-	} else if (encoded_value[0] == 'd') {
-		return decode_bencoded_dict(encoded_value, index);
-	} else {
-		throw std::runtime_error("Unhandled encoded value: " + encoded_value);
-	}
-}
-
-std::string read_file(const std::string& file_path) {
-	std::ifstream file(file_path, std::ios::binary);
-	std::stringstream buffer;
-	if (file) {
-		buffer << file.rdbuf();
-		file.close();
-		return buffer.str();
-	} else {
-		throw std::runtime_error("Failed to open file: " + file_path);
-	}
-}
-
-json parse_torrent_file(const std::string& filename) {
-	std::string encoded_torrent_meta = read_file(filename);
-	json decoded_torrent_meta = decode_bencoded_value(encoded_torrent_meta);
-
-	return decoded_torrent_meta;
-}
-
-std::string json_to_bencode(const json& j) {
-	std::ostringstream os;
-	if (j.is_object()) {
-		os << 'd';
-		for (auto& el : j.items()) {
-			os << el.key().size() << ':' << el.key()
-			   << json_to_bencode(el.value());
-		}
-		os << 'e';
-	} else if (j.is_array()) {
-		os << 'l';
-		for (const json& item : j) {
-			os << json_to_bencode(item);
-		}
-		os << 'e';
-	} else if (j.is_number_integer()) {
-		os << 'i' << j.get<int>() << 'e';
-	} else if (j.is_string()) {
-		const std::string& value = j.get<std::string>();
-		os << value.size() << ':' << value;
+	std::vector<StorageFile> files;
+	for (const TorrentFile& file : layout.files) {
+		std::filesystem::path path(output);
+		for (const std::string& component : file.path) {
+			path /= component;
+		}
+		files.push_back({path.string(), file.length});
 	}
-	return os.str();
+	return files;
 }
 
-std::string sha1_hash(const std::string& message) {
-	SHA1 sha1;
-	sha1.update(message);
-	return sha1.final();
-}
-
-std::string hex_string_to_bytes(const std::string& hex_string) {
-	std::string bytes;
-	for (size_t i = 0; i < hex_string.size(); i += 2) {
-		std::string byte_string = hex_string.substr(i, 2);
-		char byte = (char)std::strtol(byte_string.c_str(), nullptr, 16);
-		bytes.push_back(byte);
+// Opens the output and gives it its final size before anything is
+// downloaded; nullptr, after saying why, if either fails
+std::unique_ptr<Storage> open_output(const std::vector<StorageFile>& files,
+									 Storage::Allocation allocation,
+									 bool keep_existing = false) {
+	std::unique_ptr<Storage> output;
+	try {
+		output = std::make_unique<Storage>(files, keep_existing);
+	} catch (const std::system_error& e) {
+		std::cerr << "Failed to open output file: " << e.what() << std::endl;
+		return nullptr;
 	}
-	return bytes;
-}
-
-std::string byte_string_to_hex(const std::string& byte_string) {
-	std::ostringstream hex;
-	for (unsigned char c : byte_string) {
-		hex << std::hex << std::setw(2) << std::setfill('0') << (int)c;
+	if (!output->allocate(allocation)) {
+		std::cerr << "Failed to allocate the output files: "
+				  << std::strerror(errno) << std::endl;
+		return nullptr;
 	}
-	return hex.str();
+	return output;
 }
 
-std::string url_encode(const std::string& input) {
-	std::ostringstream encoded;
-	for (unsigned char c : input) {
-		if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
-			encoded << c;
-		} else {
-			encoded << '%' << std::hex << std::setw(2) << std::setfill('0')
-					<< (int)c;
+// Writes the blocks received of unfinished pieces to the files, every run
+// of them at once; false if a write failed
+bool write_partial_pieces(Storage& output, const TorrentLayout& layout,
+						  const PeerEngine& engine,
+						  const std::vector<PartialPiece>& partial) {
+	for (const PartialPiece& piece : partial) {
+		const char* data = engine.piece_data(piece.piece);
+		std::int64_t offset = (std::int64_t)piece.piece * layout.piece_length;
+		size_t block = 0;
+		while (block < piece.blocks.size()) {
+			if (!piece.blocks[block]) {
+				block++;
+				continue;
+			}
+			size_t end = block;
+			while (end < piece.blocks.size() && piece.blocks[end]) {
+				end++;
+			}
+			std::int64_t begin = (std::int64_t)block * BLOCK_LENGTH;
+			std::int64_t length =
+				std::min<std::int64_t>((std::int64_t)end * BLOCK_LENGTH,
+									   layout.piece_size(piece.piece)) -
+				begin;
+			if (!output.write(offset + begin, data + begin, length)) {
+				std::cerr << "Failed to save unfinished pieces: "
+						  << std::strerror(errno) << std::endl;
+				return false;
+			}
+			block = end;
 		}
 	}
-	return encoded.str();
+	return true;
 }
 
-std::string get_tracker_url(const json& decoded_meta) {
-	return decoded_meta["announce"];
+// --preallocate full|sparse
+Storage::Allocation parse_allocation(const std::string& value) {
+	return value == "full" ? Storage::Allocation::full
+						   : Storage::Allocation::sparse;
 }
 
-std::int64_t get_length(const json& decoded_meta) {
-	return decoded_meta["info"]["length"];
-}
-
-std::string get_info_hash(const json& decoded_meta) {
-	json info = decoded_meta["info"];
-	std::string encoded_info = json_to_bencode(info);
-	return sha1_hash(encoded_info);
-}
+std::string exchange_handshake(int sockfd, const std::string& info_hash_bytes);
 
-std::vector<std::string> get_peer_list(const json& decoded_meta) {
-	// get tracker URL
-	std::string tracker_url = get_tracker_url(decoded_meta);
-	std::cout << "Tracker URL: " + tracker_url + "\n";
-	// get info, bencode it and hash it
-	json info = decoded_meta["info"];
-	std::string info_hash_hex = get_info_hash(decoded_meta);
-	std::cout << "Info Hash Hex: " << info_hash_hex << std::endl;
-	std::string info_hash_bytes = hex_string_to_bytes(info_hash_hex);
-	std::cout << "Info Hash Bytes: " << info_hash_bytes << std::endl;
-	std::string info_hash = url_encode(info_hash_bytes);
-	std::cout << "Info Hash URL Encoded: " << info_hash << std::endl;
-	// get peer id
-	std::string peer_id = "12345678901234567890";
-	std::cout << "Peer ID: " << peer_id << std::endl;
-	// get port
-	std::int64_t port = 6881;
-	std::cout << "Port: " << port << std::endl;
-	// get length
-	std::int64_t length = get_length(decoded_meta);
-	std::cout << "Length: " + std::to_string(length) + "\n";
-	// send request to tracker
-	std::string request_url =
-		tracker_url + "?info_hash=" + info_hash + "&peer_id=" + peer_id +
-		"&port=" + std::to_string(port) +
-		"&uploaded=0&downloaded=0&left=" + std::to_string(length) +
-		"&compact=1";
-	std::cout << "Request URL: " << request_url << std::endl;
-	http::Request request(request_url);
-	http::Response response = request.send("GET");
-	std::string response_body{response.body.begin(), response.body.end()};
-	std::cout << "Response: " << response_body << std::endl;
-	json decoded_response = decode_bencoded_value(response_body);
-	// if request failed, return 1
-	if (decoded_response.find("failure reason") != decoded_response.end()) {
-		std::cerr << "Failed to get peers: "
-				  << decoded_response["failure reason"] << std::endl;
-		return {};
-	}
-	// get peer list
-	std::string peers = decoded_response["peers"];
-	std::vector<std::string> peer_list;
-	for (size_t i = 0; i < peers.size(); i += 6) {
-		std::string ip = std::to_string((unsigned char)peers[i]) + "." +
-						 std::to_string((unsigned char)peers[i + 1]) + "." +
-						 std::to_string((unsigned char)peers[i + 2]) + "." +
-						 std::to_string((unsigned char)peers[i + 3]);
-		std::int64_t port =
-			(unsigned char)peers[i + 4] << 8 | (unsigned char)peers[i + 5];
-		peer_list.push_back(ip + ":" + std::to_string(port));
-	}
-	std::cout << "Peer List: " << std::endl;
-	for (const std::string& peer : peer_list) {
-		std::cout << peer << std::endl;
-	}
-	return peer_list;
-}
-
-std::string handshake(const std::string& filename, const std::string& peer_ip,
-					  std::int64_t peer_port, int& sockfd) {
+std::string handshake(const std::string& filename, const PeerEndpoint& peer,
+					  int& sockfd) {
 	// create a socket
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	sockfd = socket(peer.family, SOCK_STREAM, 0);
 	if (sockfd < 0) {
 		std::cerr << "Failed to create socket" << std::endl;
 		return "";
 	}
 	// define the server address
-	struct sockaddr_in serv_addr;
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_port = htons(peer_port);
-	if (inet_pton(AF_INET, peer_ip.c_str(), &serv_addr.sin_addr) <= 0) {
-		std::cerr << "Invalid address: " << peer_ip << std::endl;
-		return "";
-	}
+	sockaddr_storage serv_addr;
+	socklen_t serv_addr_length = peer.to_sockaddr(serv_addr);
 	// connect to the server
-	if (connect(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+	if (connect(sockfd, (struct sockaddr*)&serv_addr, serv_addr_length) < 0) {
 		std::cerr << "Failed to connect to peer" << std::endl;
 		return "";
 	}
-	// prepare handshake message
 	json decoded_meta = parse_torrent_file(filename);
 	std::string info_hash_hex =
 		sha1_hash(json_to_bencode(decoded_meta["info"]));
 	std::string info_hash_bytes = hex_string_to_bytes(info_hash_hex);
+	return exchange_handshake(sockfd, info_hash_bytes);
+}
+
+// Sends our handshake on a connected socket and checks the reply, returns
+// the remote peer id in hex or "" on failure
+std::string exchange_handshake(int sockfd, const std::string& info_hash_bytes) {
+	// prepare handshake message
 	std::vector<char> handshake_message;
 	char protocol_length = 19;
 	handshake_message.push_back(protocol_length);
@@ -308,8 +193,8 @@ std::string handshake(const std::string& filename, const std::string& peer_ip,
 	}
 	// receive handshake message
 	std::vector<char> handshake_response(68);
-	if (recv(sockfd, handshake_response.data(), handshake_response.size(), 0) <
-		0) {
+	if (recv(sockfd, handshake_response.data(), handshake_response.size(),
+			 MSG_WAITALL) != (ssize_t)handshake_response.size()) {
 		std::cerr << "Failed to receive handshake response" << std::endl;
 		return "";
 	}
@@ -403,10 +288,10 @@ int main(int argc, char* argv[]) {
 		}
 		std::string filename = argv[2];
 		json decoded_meta = parse_torrent_file(filename);
-		std::vector<std::string> peer_list = get_peer_list(decoded_meta);
+		std::vector<PeerEndpoint> peer_list = get_peer_list(decoded_meta);
 		std::cout << "Peers: " << std::endl;
-		for (const std::string& peer : peer_list) {
-			std::cout << peer << std::endl;
+		for (const PeerEndpoint& peer : peer_list) {
+			std::cout << peer.to_string() << std::endl;
 		}
 	} else if (command == "handshake") {
 		if (argc < 4) {
@@ -416,326 +301,352 @@ int main(int argc, char* argv[]) {
 		}
 		std::string filename = argv[2];
 		std::string peer_ip_port = argv[3];
-		std::string peer_ip;
-		std::int64_t peer_port;
-		size_t colon_index = peer_ip_port.find(':');
-		if (colon_index != std::string::npos) {
-			peer_ip = peer_ip_port.substr(0, colon_index);
-			peer_port = std::stoll(peer_ip_port.substr(colon_index + 1));
-		} else {
+		std::optional<PeerEndpoint> peer = PeerEndpoint::parse(peer_ip_port);
+		if (!peer) {
 			std::cerr << "Invalid peer IP:Port: " << peer_ip_port << std::endl;
 			return 1;
 		}
 		int sockfd = 0;
-		std::string peer_id_hex =
-			handshake(filename, peer_ip, peer_port, sockfd);
+		std::string peer_id_hex = handshake(filename, *peer, sockfd);
 		std::cout << "Handshake successful" << std::endl;
 		std::cout << "Peer ID: " << peer_id_hex << std::endl;
 	} else if (command == "download_piece") {
 		if (argc < 6) {
 			std::cerr << "Usage: " << argv[0]
 					  << " download_piece -o <output_file> <torrent_file> 0"
+					  << " [--queue-depth n] [--preallocate full|sparse]"
 					  << std::endl;
 			return 1;
 		}
 		std::string output_file = argv[3];
 		std::string filename = argv[4];
 		std::int32_t piece_index = std::stoll(argv[5]);
+		PeerEngineOptions options;
+		Storage::Allocation allocation = Storage::Allocation::sparse;
+		for (int i = 6; i + 1 < argc; i += 2) {
+			std::string option = argv[i];
+			if (option == "--queue-depth") {
+				options.queue_depth = std::max(1LL, std::stoll(argv[i + 1]));
+			} else if (option == "--preallocate") {
+				allocation = parse_allocation(argv[i + 1]);
+			}
+		}
 		json decoded_meta = parse_torrent_file(filename);
-		// get peer list
-		std::vector<std::string> peer_list = get_peer_list(decoded_meta);
-		if (peer_list.empty()) {
-			std::cerr << "Failed to get peer list" << std::endl;
+		TorrentLayout layout = get_torrent_layout(decoded_meta);
+		if (piece_index < 0 ||
+			(std::uint32_t)piece_index >= layout.piece_count()) {
+			std::cerr << "Invalid piece index: " << piece_index << std::endl;
 			return 1;
 		}
-		// get first peer
-		std::string peer_ip_port = peer_list[0];
-		std::string peer_ip;
-		std::int64_t peer_port;
-		size_t colon_index = peer_ip_port.find(':');
-		if (colon_index != std::string::npos) {
-			peer_ip = peer_ip_port.substr(0, colon_index);
-			peer_port = std::stoll(peer_ip_port.substr(colon_index + 1));
-		} else {
-			std::cerr << "Invalid peer IP:Port: " << peer_ip_port << std::endl;
+		std::unique_ptr<Storage> output = open_output(
+			{{output_file, layout.piece_size(piece_index)}}, allocation);
+		if (!output) {
 			return 1;
 		}
-		// handshake
-		int sockfd = 0;
-		std::string peer_id_hex =
-			handshake(filename, peer_ip, peer_port, sockfd);
-		std::cout << "Handshake successful" << std::endl;
-		std::cout << "Peer ID: " << peer_id_hex << std::endl;
-		// wait for bitfield message
-		std::vector<char> bitfield_message_length_prefix(4);
-		if (recv(sockfd, bitfield_message_length_prefix.data(),
-				 bitfield_message_length_prefix.size(), 0) < 0) {
-			std::cerr << "Failed to receive message length" << std::endl;
+		PeerCache peer_cache(layout.info_hash);
+		// the announce thread may outlive this scope, hence shared ownership
+		auto engine = std::make_shared<PeerEngine>(layout, options);
+		engine->want_piece(piece_index);
+		std::vector<char> piece_data;
+		engine->on_piece = [&](std::uint32_t, std::vector<char>& data) {
+			piece_data = std::move(data);
+		};
+		// dial the peers that worked last time while the tracker is asked,
+		// so a restart does not wait for the announce
+		attach_peer_cache(*engine, peer_cache);
+		engine->expect_more_peers(true);
+		std::thread([engine, decoded_meta] {
+			engine->add_peers(get_peer_list(decoded_meta));
+			engine->expect_more_peers(false);
+		}).detach();
+		bool ok = engine->run();
+		peer_cache.save();
+		if (!ok) {
+			std::cerr << "Failed to download piece " << piece_index
+					  << std::endl;
 			return 1;
 		}
-		std::int32_t bitfield_message_length =
-			(static_cast<std::uint8_t>(bitfield_message_length_prefix[0])
-			 << 24) |
-			(static_cast<std::uint8_t>(bitfield_message_length_prefix[1])
-			 << 16) |
-			(static_cast<std::uint8_t>(bitfield_message_length_prefix[2])
-			 << 8) |
-			static_cast<std::uint8_t>(bitfield_message_length_prefix[3]);
-		std::cout << "Bitfield Message Length: " << bitfield_message_length
-				  << std::endl;
-		std::vector<char> bitfield_message(bitfield_message_length + 1);
-		if (recv(sockfd, bitfield_message.data(), bitfield_message_length + 1,
-				 0) < 0) {
-			std::cerr << "Failed to receive bitfield message" << std::endl;
+		if (!output->write(0, piece_data.data(), piece_data.size()) ||
+			!output->close()) {
+			std::cerr << "Failed to write output file: " << output_file << ": "
+					  << std::strerror(errno) << std::endl;
 			return 1;
 		}
-		if (bitfield_message[0] != 5) {
-			std::cerr << "Invalid bitfield message: "
-					  << (int)bitfield_message[0];
+		std::cout << "Piece " << piece_index << " downloaded to "
+				  << output_file << std::endl;
+	} else if (command == "download") {
+		if (argc < 5) {
+			std::cerr << "Usage: " << argv[0]
+					  << " download -o <output_file> <torrent_file>"
+					  << " [--queue-depth n] [--cache-mb n]"
+					  << " [--storage pwrite|mmap] [--preallocate full|sparse]"
+					  << std::endl;
 			return 1;
 		}
-		std::cout << "Received bitfield message" << std::endl;
-		std::cout << "Bitfield message content: "
-				  << byte_string_to_hex(bitfield_message.data()) << std::endl;
-		// send interested message
-		const u_int INTERESTED = 2;
-		std::vector<char> interested_message = {0, 0, 0, 1, INTERESTED};
-		if (send(sockfd, interested_message.data(), interested_message.size(),
-				 0) < 0) {
-			std::cerr << "Failed to send interested message" << std::endl;
-			return 1;
+		std::string output_file = argv[3];
+		std::string filename = argv[4];
+		PeerEngineOptions options;
+		bool use_mmap = false;
+		Storage::Allocation allocation = Storage::Allocation::sparse;
+		for (int i = 5; i + 1 < argc; i += 2) {
+			std::string option = argv[i];
+			if (option == "--queue-depth") {
+				options.queue_depth = std::max(1LL, std::stoll(argv[i + 1]));
+			} else if (option == "--cache-mb") {
+				options.max_buffered_bytes =
+					std::max(1LL, std::stoll(argv[i + 1])) << 20;
+			} else if (option == "--storage") {
+				use_mmap = std::string(argv[i + 1]) == "mmap";
+			} else if (option == "--preallocate") {
+				allocation = parse_allocation(argv[i + 1]);
+			}
 		}
-		// wait for unchoke message
-		std::vector<char> unchoke_message_length_prefix(4);
-		if (recv(sockfd, unchoke_message_length_prefix.data(),
-				 unchoke_message_length_prefix.size(), 0) < 0) {
-			std::cerr << "Failed to receive message length" << std::endl;
+		json decoded_meta = parse_torrent_file(filename);
+		TorrentLayout layout = get_torrent_layout(decoded_meta);
+		std::vector<StorageFile> files = storage_files(layout, output_file);
+		// what an earlier run left in the files is kept and checked
+		ResumeData resume(layout.info_hash, layout.piece_count(), files);
+		std::unique_ptr<Storage> output = open_output(files, allocation, true);
+		if (!output) {
 			return 1;
 		}
-		std::int32_t unchoke_message_length =
-			(static_cast<std::uint8_t>(unchoke_message_length_prefix[0])
-			 << 24) |
-			(static_cast<std::uint8_t>(unchoke_message_length_prefix[1])
-			 << 16) |
-			(static_cast<std::uint8_t>(unchoke_message_length_prefix[2]) << 8) |
-			static_cast<std::uint8_t>(unchoke_message_length_prefix[3]);
-		std::cout << "Unchoke Message Length: " << unchoke_message_length
-				  << std::endl;
-		std::vector<char> unchoke_message(unchoke_message_length + 1);
-		if (recv(sockfd, unchoke_message.data(), unchoke_message_length + 1,
-				 0) < 0) {
-			std::cerr << "Failed to receive unchoke message" << std::endl;
-			return 1;
+		std::vector<bool> have = resume.check(layout, *output);
+		PeerCache peer_cache(layout.info_hash);
+		PeerEngine engine(layout, options);
+		std::int64_t left = layout.total_length;
+		std::uint32_t resumed = 0;
+		for (std::uint32_t piece = 0; piece < have.size(); piece++) {
+			if (have[piece]) {
+				engine.mark_done(piece);
+				left -= layout.piece_size(piece);
+				resumed++;
+			}
 		}
-		if (unchoke_message[0] != 1) {
-			std::cerr << "Invalid unchoke message: " << (int)unchoke_message[0]
+		if (resumed > 0) {
+			std::cout << "Resuming with " << resumed << " of "
+					  << layout.piece_count() << " pieces on disk"
 					  << std::endl;
-			return 1;
 		}
-		std::cout << "Received unchoke message" << std::endl;
-		std::cout << "Unchoke message content: "
-				  << byte_string_to_hex(unchoke_message.data()) << std::endl;
-		// send request message
-		std::int64_t file_length = get_length(decoded_meta);
-		std::cout << "File Length: " << file_length << std::endl;
-		std::int64_t piece_length = decoded_meta["info"]["piece length"];
-		std::cout << "Piece Length: " << piece_length << std::endl;
-		std::int64_t piece_offset = piece_index * piece_length;
-		std::cout << "Piece Offset: " << piece_offset << std::endl;
-		std::int64_t curr_piece_length =
-			std::min(piece_length, file_length - piece_offset);
-		std::cout << "Current Piece Length: " << curr_piece_length << std::endl;
-		std::int64_t block_length = 16384;	// 2^14 bytes = 16 KB
-		std::int64_t num_blocks = curr_piece_length / block_length;
-		if (curr_piece_length % block_length != 0) {
-			num_blocks++;
-		}
-		std::cout << "Num Blocks: " << num_blocks << std::endl;
-		/* std::int64_t remaining_length = curr_piece_length;
-		for (std::int64_t i = 0; i < num_blocks; i++) {
-			std::int32_t block_offset = i * block_length;
-			std::cout << "Block Offset: " << block_offset << std::endl;
-			std::int32_t curr_block_length =
-				std::min(remaining_length, block_length);
-			std::cout << "Current Block Length: " << curr_block_length
-					  << std::endl;
-			std::vector<char> request_message = {0, 0, 0, 13, 6};
-			request_message.push_back(piece_index >> 24);
-			request_message.push_back(piece_index >> 16);
-			request_message.push_back(piece_index >> 8);
-			request_message.push_back(piece_index);
-			request_message.push_back(block_offset >> 24);
-			request_message.push_back(block_offset >> 16);
-			request_message.push_back(block_offset >> 8);
-			request_message.push_back(block_offset);
-			request_message.push_back(curr_block_length >> 24);
-			request_message.push_back(curr_block_length >> 16);
-			request_message.push_back(curr_block_length >> 8);
-			request_message.push_back(curr_block_length);
-			if (send(sockfd, request_message.data(), request_message.size(),
-					 0) < 0) {
-				std::cerr << "Failed to send request message" << std::endl;
+		std::int64_t fetching = left;
+		engine.want_all();
+		attach_peer_cache(engine, peer_cache);
+		// pieces verified since the resume data was last saved
+		std::vector<std::uint32_t> unsaved;
+		std::optional<DiskWriter> disk;
+		if (use_mmap && layout.multi_file) {
+			std::cerr << "mmap storage needs a single-file torrent, using "
+					  << "pwrite" << std::endl;
+			use_mmap = false;
+		}
+		if (use_mmap && layout.total_length == 0) {
+			// there is nothing to map, mmap refuses a length of 0
+			use_mmap = false;
+		}
+		if (use_mmap) {
+			// blocks land in the mapped file, a verified piece only has to
+			// be pushed towards the disk
+			char* mapping = output->map();
+			if (!mapping) {
+				std::cerr << "Failed to map output file: "
+						  << std::strerror(errno) << std::endl;
 				return 1;
 			}
-			std::cout << "Sent request message" << std::endl;
-			// receive block message
-			std::vector<char> block_message_length_prefix(4, 0);
-			std::int32_t block_message_length = 0;
-			for (int i = 0; i < 4; i++) {
-				if (recv(sockfd, block_message_length_prefix.data() + i, 1, 0) <
-					0) {
-					std::cerr << "Failed to receive message length"
-							  << std::endl;
-					return 1;
+			engine.set_piece_memory(mapping);
+			for (const PartialPiece& partial : resume.partial_pieces()) {
+				engine.resume_piece(partial);
+			}
+			engine.on_piece = [&](std::uint32_t piece, std::vector<char>&) {
+				unsaved.push_back(piece);
+				left -= layout.piece_size(piece);
+				output->flush_range((std::int64_t)piece * layout.piece_length,
+									layout.piece_size(piece));
+			};
+		} else {
+			// pieces are written back on the disk thread and their buffers
+			// return to the engine, which stops starting pieces while too
+			// many are waiting
+			disk.emplace(*output, [&engine](std::vector<char>&& buffer,
+											 bool written) {
+				// the pieces stay unsaved, flush() fails the download
+				if (!written) {
+					engine.stop();
+				}
+				engine.recycle(std::move(buffer));
+			});
+			std::vector<char> data;
+			for (const PartialPiece& partial : resume.partial_pieces()) {
+				std::int64_t offset =
+					(std::int64_t)partial.piece * layout.piece_length;
+				data.resize(layout.piece_size(partial.piece));
+				if (output->read(offset, data.data(), data.size())) {
+					engine.resume_piece(partial, data.data());
 				}
 			}
-			for (int i = 0; i < 4; i++) {
-				std::cout << "Block Message Length Prefix[" << i
-						  << "]: " << (int)block_message_length_prefix[i]
-						  << std::endl;
+			engine.on_piece = [&](std::uint32_t piece,
+								  std::vector<char>& data) {
+				unsaved.push_back(piece);
+				left -= data.size();
+				disk->write((std::int64_t)piece * layout.piece_length,
+							std::move(data));
+			};
+		}
+		// the scheduler keeps announcing (re-announcing early while short of
+		// peers) for as long as the download runs; while every tracker is
+		// failing, running out of peers ends it
+		engine.expect_more_peers(true);
+		AnnounceRequest request;
+		request.info_hash = layout.info_hash;
+		request.peer_id = options.peer_id;
+		request.left = left;
+		AnnounceThread announcer(
+			get_announce_tiers(decoded_meta), request,
+			[&engine](const std::vector<PeerEndpoint>& peers) {
+				engine.add_peers(peers);
+			},
+			[&engine](bool reachable) { engine.expect_more_peers(reachable); });
+		// Pieces only count once they are in the files, so the disk thread
+		// writes what it has first; the mtimes saved are taken after that.
+		// With pwrite the blocks of unfinished pieces are only in their
+		// buffers and are written out here, the disk thread is idle.
+		auto save_resume = [&] {
+			if (disk && !disk->flush()) {
+				return;
 			}
-			block_message_length =
-				(static_cast<std::uint8_t>(block_message_length_prefix[0])
-				 << 24) |
-				(static_cast<std::uint8_t>(block_message_length_prefix[1])
-				 << 16) |
-				(static_cast<std::uint8_t>(block_message_length_prefix[2])
-				 << 8) |
-				static_cast<std::uint8_t>(block_message_length_prefix[3]);
-			std::cout << "Block Message Length: " << block_message_length
-					  << std::endl;
-
-			std::vector<char> block_message(block_message_length + 1);
-			if (recv(sockfd, block_message.data(), block_message.size(), 0) <
-				0) {
-				std::cerr << "Failed to receive piece message" << std::endl;
-				return 1;
+			for (std::uint32_t piece : unsaved) {
+				resume.set_piece(piece);
 			}
-			if (block_message[0] != 7) {
-				std::cerr << "Invalid block message: " << (int)block_message[0]
-						  << std::endl;
-				return 1;
+			unsaved.clear();
+			std::vector<PartialPiece> partial = engine.partial_pieces();
+			if (disk && !write_partial_pieces(*output, layout, engine,
+											  partial)) {
+				partial.clear();
 			}
-			std::cout << "Received block message" << std::endl;
-			std::int32_t received_piece_index =
-				(block_message[1] << 24) | (block_message[2] << 16) |
-				(block_message[3] << 8) | block_message[4];
-			std::cout << "Received Piece Index: " << received_piece_index
-					  << std::endl;
-			std::int32_t received_block_offset =
-				(block_message[5] << 24) | (block_message[6] << 16) |
-				(block_message[7] << 8) | block_message[8];
-			std::cout << "Received Block Offset: " << received_block_offset
-					  << std::endl;
-			// open output file with append mode
-			std::ofstream output(output_file, std::ios::binary | std::ios::app);
-			// write block to output file
-			if (output) {
-				output.write(block_message.data() + 9, curr_block_length);
-				output.close();
-			} else {
-				std::cerr << "Failed to open output file: " << output_file
-						  << std::endl;
-				return 1;
+			// nothing is claimed that a power cut could still take back
+			if (!output->sync()) {
+				std::cerr << "Failed to sync the output files: "
+						  << std::strerror(errno) << std::endl;
+				return;
+			}
+			resume.set_partial_pieces(std::move(partial));
+			resume.save();
+		};
+		auto last_save = std::chrono::steady_clock::now();
+		engine.on_tick = [&] {
+			announcer.report(engine.downloaded(), left, engine.peer_count());
+			auto now = std::chrono::steady_clock::now();
+			if (!unsaved.empty() && now - last_save >= RESUME_SAVE_INTERVAL) {
+				save_resume();
+				last_save = now;
 			}
-			remaining_length -= curr_block_length;
-			std::cout << "Downloaded block " << i << std::endl;
-			std::cout << "==============================================="
+		};
+		running_engine = &engine;
+		std::signal(SIGINT, stop_download);
+		std::signal(SIGTERM, stop_download);
+		auto start = std::chrono::steady_clock::now();
+		bool ok = engine.run();
+		std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now() - start;
+		std::signal(SIGINT, SIG_DFL);
+		std::signal(SIGTERM, SIG_DFL);
+		running_engine = nullptr;
+		peer_cache.save();
+		bool written = !disk || disk->flush();
+		if (written) {
+			save_resume();
+		}
+		written = output->close() && written;
+		if (!ok && written && engine.stopped()) {
+			std::cerr << "Stopped, the next run resumes from here"
 					  << std::endl;
+			return 1;
 		}
-		std::cout << "Downloaded piece " << piece_index << std::endl; */
-
-		std::int64_t remaining_length = curr_piece_length;
-		std::int32_t block_offset = 0;
-		for (std::int64_t i = 0; i < num_blocks; i++) {
-			std::int32_t curr_block_length =
-				std::min(remaining_length, block_length);
-			std::cout << "Current Block Length: " << curr_block_length
+		if (!ok || !written) {
+			std::cerr << "Failed to download " << filename << std::endl;
+			return 1;
+		}
+		announcer.complete();
+		std::cout << "Downloaded " << filename << " to " << output_file << "."
+				  << std::endl;
+		std::cout << fetching << " bytes in " << std::fixed
+				  << std::setprecision(2) << elapsed.count() << " s ("
+				  << fetching / elapsed.count() / 1e6 << " MB/s)" << std::endl;
+	} else if (command == "scrape") {
+		if (argc < 3) {
+			std::cerr << "Usage: " << argv[0] << " scrape <filename>..."
 					  << std::endl;
-
-			// Prepare the request message
-			std::vector<char> request_message = {0, 0, 0, 13, 6};
-			request_message.push_back(piece_index >> 24);
-			request_message.push_back(piece_index >> 16);
-			request_message.push_back(piece_index >> 8);
-			request_message.push_back(piece_index);
-			request_message.push_back(block_offset >> 24);
-			request_message.push_back(block_offset >> 16);
-			request_message.push_back(block_offset >> 8);
-			request_message.push_back(block_offset);
-			request_message.push_back(curr_block_length >> 24);
-			request_message.push_back(curr_block_length >> 16);
-			request_message.push_back(curr_block_length >> 8);
-			request_message.push_back(curr_block_length);
-
-			// Send the request
-			if (send(sockfd, request_message.data(), request_message.size(),
-					 0) < 0) {
-				std::cerr << "Failed to send request message" << std::endl;
-				return 1;
+			return 1;
+		}
+		// one batched scrape per tracker
+		std::map<std::string, std::vector<std::string>> info_hashes_by_tracker;
+		for (int i = 2; i < argc; i++) {
+			json decoded_meta = parse_torrent_file(argv[i]);
+			std::vector<std::vector<std::string>> tiers =
+				get_announce_tiers(decoded_meta);
+			if (tiers.empty()) {
+				std::cerr << "No tracker in " << argv[i] << std::endl;
+				continue;
 			}
-			std::cout << "Sent request message" << std::endl;
-
-			// Receive the block message length prefix in a loop
-			std::vector<char> block_message_length_prefix(4, 0);
-			for (int j = 0; j < 4; j++) {
-				if (recv(sockfd, block_message_length_prefix.data() + j, 1, 0) <
-					0) {
-					std::cerr << "Failed to receive message length"
-							  << std::endl;
-					return 1;
+			info_hashes_by_tracker[tiers[0][0]].push_back(
+				hex_string_to_bytes(get_info_hash(decoded_meta)));
+		}
+		for (const auto& [tracker_url, info_hashes] : info_hashes_by_tracker) {
+			ScrapeResponse response = scrape(tracker_url, info_hashes);
+			if (!response.ok) {
+				std::cerr << "Failed to scrape " << tracker_url << ": "
+						  << response.failure_reason << std::endl;
+				continue;
+			}
+			for (const ScrapeResult& result : response.files) {
+				std::cout << byte_string_to_hex(result.info_hash) << ": ";
+				if (result.ok) {
+					std::cout << "seeders=" << result.seeders
+							  << " completed=" << result.completed
+							  << " leechers=" << result.leechers << std::endl;
+				} else {
+					std::cout << "unknown to tracker" << std::endl;
 				}
 			}
-
-			std::int32_t block_message_length =
-				(static_cast<std::uint8_t>(block_message_length_prefix[0])
-				 << 24) |
-				(static_cast<std::uint8_t>(block_message_length_prefix[1])
-				 << 16) |
-				(static_cast<std::uint8_t>(block_message_length_prefix[2])
-				 << 8) |
-				static_cast<std::uint8_t>(block_message_length_prefix[3]);
-			std::cout << "Block Message Length: " << block_message_length
-					  << std::endl;
-
-			// Receive the actual block message
-			std::vector<char> block_message(block_message_length + 1);
-			ssize_t received_bytes = 0;
-			while (received_bytes < block_message_length + 1) {
-				ssize_t result =
-					recv(sockfd, block_message.data() + received_bytes,
-						 block_message.size() - received_bytes, 0);
-				if (result <= 0) {
-					std::cerr << "Failed to receive piece message" << std::endl;
+		}
+	} else if (command == "mock_tracker") {
+		MockTrackerOptions options;
+		for (int i = 2; i < argc; i++) {
+			std::string arg = argv[i];
+			if (arg == "--http" && i + 1 < argc) {
+				options.http_port = std::stoi(argv[++i]);
+			} else if (arg == "--udp" && i + 1 < argc) {
+				options.udp_port = std::stoi(argv[++i]);
+			} else if (arg == "--peer" && i + 1 < argc) {
+				std::optional<PeerEndpoint> peer = PeerEndpoint::parse(argv[++i]);
+				if (!peer) {
+					std::cerr << "Invalid peer IP:Port: " << argv[i] << std::endl;
 					return 1;
 				}
-				received_bytes += result;
-			}
-
-			// Validate message type
-			if (block_message[0] != 7) {
-				std::cerr << "Invalid block message: " << (int)block_message[0]
-						  << std::endl;
-				return 1;
-			}
-
-			// Write block to output file
-			std::ofstream output(output_file, std::ios::binary | std::ios::app);
-			if (output) {
-				output.write(block_message.data() + 9, curr_block_length);
-				output.close();
+				options.peers.push_back(*peer);
+			} else if (arg == "--interval" && i + 1 < argc) {
+				options.interval = std::stoll(argv[++i]);
+			} else if (arg == "--min-interval" && i + 1 < argc) {
+				options.min_interval = std::stoll(argv[++i]);
+			} else if (arg == "--delay" && i + 1 < argc) {
+				options.delay = std::chrono::milliseconds(std::stoll(argv[++i]));
+			} else if (arg == "--failure" && i + 1 < argc) {
+				options.failure_reason = argv[++i];
+			} else if (arg == "--drop-rate" && i + 1 < argc) {
+				options.drop_rate = std::stod(argv[++i]);
 			} else {
-				std::cerr << "Failed to open output file: " << output_file
-						  << std::endl;
-				return 1;
+				options.http_port = options.udp_port = 0;
+				break;
 			}
-
-			remaining_length -= curr_block_length;
-			block_offset += curr_block_length;	// Move to the next block offset
-			std::cout << "Downloaded block " << i << std::endl;
-			std::cout << "==============================================="
+		}
+		if (options.http_port == 0 && options.udp_port == 0) {
+			std::cerr << "Usage: " << argv[0]
+					  << " mock_tracker [--http <port>] [--udp <port>]"
+					  << " [--peer <ip:port>]... [--interval <seconds>]"
+					  << " [--min-interval <seconds>] [--delay <ms>]"
+					  << " [--failure <reason>] [--drop-rate <0..1>]"
 					  << std::endl;
+			return 1;
 		}
+		run_mock_tracker(options);
 	} else {
 		std::cerr << "unknown command: " << command << std::endl;
 		return 1;
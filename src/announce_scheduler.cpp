@@ -0,0 +1,239 @@
+#include "announce_scheduler.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <utility>
+
+namespace {
+
+// used until a tracker tells otherwise
+constexpr std::chrono::seconds DEFAULT_INTERVAL{1800};
+// floor when the tracker sends no min interval
+constexpr std::chrono::seconds DEFAULT_MIN_INTERVAL{60};
+// first retry after a failed announce, doubled on every further failure
+constexpr std::chrono::seconds RETRY_INTERVAL{30};
+// failed announces in a row before the trackers count as unreachable
+constexpr int UNREACHABLE_FAILURES = 3;
+// how often AnnounceThread looks at the reported peer count
+constexpr std::chrono::seconds REPORT_POLL{5};
+
+}  // namespace
+
+AnnounceScheduler::AnnounceScheduler(size_t target_peers,
+									 AnnounceFunction announce)
+	: target_peers_(target_peers), announce_(std::move(announce)) {}
+
+AnnounceScheduler::TorrentId AnnounceScheduler::add_torrent(
+	std::vector<std::vector<std::string>> tiers, AnnounceRequest request) {
+	TorrentId id = next_id_++;
+	Torrent& torrent = torrents_[id];
+	torrent.tiers = std::move(tiers);
+	torrent.request = std::move(request);
+	torrent.request.event = AnnounceEvent::started;
+	torrent.interval = DEFAULT_INTERVAL;
+	torrent.min_interval = DEFAULT_MIN_INTERVAL;
+	schedule(id, torrent, Clock::time_point::min());
+	return id;
+}
+
+void AnnounceScheduler::update(TorrentId id, std::int64_t uploaded,
+							   std::int64_t downloaded, std::int64_t left,
+							   size_t peer_count) {
+	auto it = torrents_.find(id);
+	if (it == torrents_.end()) {
+		return;
+	}
+	Torrent& torrent = it->second;
+	torrent.request.uploaded = uploaded;
+	torrent.request.downloaded = downloaded;
+	torrent.request.left = left;
+	bool was_starved = torrent.peer_count < target_peers_;
+	torrent.peer_count = peer_count;
+	// running low on peers: pull the next announce in, within min interval
+	if (!was_starved && peer_count < target_peers_ && torrent.failures == 0) {
+		Clock::time_point earliest =
+			torrent.last_announce + earliest_reannounce(torrent);
+		if (earliest < torrent.next_announce) {
+			schedule(id, torrent, earliest);
+		}
+	}
+}
+
+void AnnounceScheduler::complete(TorrentId id) {
+	auto it = torrents_.find(id);
+	if (it == torrents_.end()) {
+		return;
+	}
+	it->second.request.event = AnnounceEvent::completed;
+	it->second.request.left = 0;
+	schedule(id, it->second, Clock::time_point::min());
+}
+
+void AnnounceScheduler::remove(TorrentId id) {
+	auto it = torrents_.find(id);
+	if (it == torrents_.end()) {
+		return;
+	}
+	Torrent& torrent = it->second;
+	// a torrent the tracker never heard of needs no stopped event
+	if (torrent.last_announce != Clock::time_point{}) {
+		torrent.request.event = AnnounceEvent::stopped;
+		torrent.request.numwant = 0;
+		announce_(torrent.tiers, torrent.request);
+	}
+	// the heap entry goes stale and is skipped
+	torrents_.erase(it);
+}
+
+void AnnounceScheduler::run_due(Clock::time_point now) {
+	while (!timers_.empty() && timers_.top().when <= now) {
+		Timer timer = timers_.top();
+		timers_.pop();
+		auto it = torrents_.find(timer.id);
+		if (it == torrents_.end() ||
+			it->second.generation != timer.generation) {
+			continue;
+		}
+		announce(timer.id, it->second, now);
+	}
+}
+
+AnnounceScheduler::Clock::time_point AnnounceScheduler::next_due() const {
+	return timers_.empty() ? Clock::time_point::max() : timers_.top().when;
+}
+
+void AnnounceScheduler::schedule(TorrentId id, Torrent& torrent,
+								 Clock::time_point when) {
+	torrent.next_announce = when;
+	timers_.push({when, id, ++torrent.generation});
+}
+
+std::chrono::seconds AnnounceScheduler::earliest_reannounce(
+	const Torrent& torrent) const {
+	return std::min(torrent.min_interval, torrent.interval);
+}
+
+void AnnounceScheduler::announce(TorrentId id, Torrent& torrent,
+								 Clock::time_point now) {
+	bool wants_peers = torrent.peer_count < target_peers_ &&
+					   torrent.request.event != AnnounceEvent::completed;
+	torrent.request.numwant =
+		wants_peers ? static_cast<std::int64_t>(target_peers_ -
+												torrent.peer_count)
+					: 0;
+	AnnounceResponse response = announce_(torrent.tiers, torrent.request);
+	torrent.last_announce = now;
+
+	if (!response.ok) {
+		std::cerr << "Announce failed: " << response.failure_reason
+				  << std::endl;
+		auto retry = std::min<std::chrono::seconds>(
+			RETRY_INTERVAL * (1 << std::min(torrent.failures, 10)),
+			torrent.interval);
+		torrent.failures++;
+		schedule(id, torrent, now + retry);
+		if (on_reachable && torrent.failures == UNREACHABLE_FAILURES) {
+			on_reachable(id, false);
+		}
+		return;
+	}
+
+	if (on_reachable && torrent.failures >= UNREACHABLE_FAILURES) {
+		on_reachable(id, true);
+	}
+	torrent.failures = 0;
+	torrent.request.event = AnnounceEvent::none;
+	if (response.interval > 0) {
+		torrent.interval = std::chrono::seconds(response.interval);
+	}
+	torrent.min_interval = response.min_interval > 0
+							   ? std::chrono::seconds(response.min_interval)
+							   : DEFAULT_MIN_INTERVAL;
+	if (on_peers && !response.peers.empty()) {
+		on_peers(id, response.peers);
+	}
+
+	// +-5% so that torrents started together do not announce together
+	std::int64_t spread = torrent.interval.count() / 20;
+	std::uniform_int_distribution<std::int64_t> jitter(-spread, spread);
+	std::chrono::seconds delay = torrent.interval +
+								 std::chrono::seconds(jitter(rng_));
+	if (torrent.peer_count + response.peers.size() < target_peers_) {
+		delay = earliest_reannounce(torrent);
+	}
+	schedule(id, torrent,
+			 now + std::max(delay, earliest_reannounce(torrent)));
+}
+
+AnnounceThread::AnnounceThread(std::vector<std::vector<std::string>> tiers,
+							   AnnounceRequest request, PeersCallback on_peers,
+							   ReachableCallback on_reachable)
+	: on_peers_(std::move(on_peers)),
+	  on_reachable_(std::move(on_reachable)),
+	  left_(request.left) {
+	thread_ = std::thread(&AnnounceThread::run, this, std::move(tiers),
+						  std::move(request));
+}
+
+AnnounceThread::~AnnounceThread() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	wake_.notify_one();
+	thread_.join();
+}
+
+void AnnounceThread::report(std::int64_t downloaded, std::int64_t left,
+							size_t peer_count) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	downloaded_ = downloaded;
+	left_ = left;
+	peer_count_ = peer_count;
+}
+
+void AnnounceThread::complete() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		complete_ = true;
+		left_ = 0;
+	}
+	wake_.notify_one();
+}
+
+void AnnounceThread::run(std::vector<std::vector<std::string>> tiers,
+						 AnnounceRequest request) {
+	AnnounceScheduler scheduler;
+	scheduler.on_peers = [this](AnnounceScheduler::TorrentId,
+								const std::vector<PeerEndpoint>& peers) {
+		on_peers_(peers);
+	};
+	if (on_reachable_) {
+		scheduler.on_reachable = [this](AnnounceScheduler::TorrentId,
+										bool reachable) {
+			on_reachable_(reachable);
+		};
+	}
+	AnnounceScheduler::TorrentId id =
+		scheduler.add_torrent(std::move(tiers), std::move(request));
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true) {
+		bool complete = std::exchange(complete_, false);
+		bool stop = stop_;
+		scheduler.update(id, 0, downloaded_, left_, peer_count_);
+		lock.unlock();
+		if (complete) {
+			scheduler.complete(id);
+		}
+		scheduler.run_due();
+		if (stop) {
+			scheduler.remove(id);
+			return;
+		}
+		lock.lock();
+		wake_.wait_until(lock,
+						 std::min(scheduler.next_due(),
+								  AnnounceScheduler::Clock::now() + REPORT_POLL),
+						 [this] { return complete_ || stop_; });
+	}
+}
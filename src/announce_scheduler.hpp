@@ -0,0 +1,124 @@
+#ifndef ANNOUNCE_SCHEDULER_HPP
+#define ANNOUNCE_SCHEDULER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "tracker.hpp"
+
+// Keeps the next announce time of every torrent in a timer heap, so the
+// cost of a tick does not depend on how many torrents are idle. Regular
+// announces follow the tracker's interval (with jitter, so torrents added
+// together drift apart) and are never sent before min interval; a torrent
+// short of peers re-announces as early as min interval allows, and asks
+// for no peers at all once it has enough.
+class AnnounceScheduler {
+   public:
+	using Clock = std::chrono::steady_clock;
+	using TorrentId = std::uint64_t;
+	using PeersCallback =
+		std::function<void(TorrentId, const std::vector<PeerEndpoint>&)>;
+	// false once every tier has failed several announces in a row, true
+	// when one gets through again
+	using ReachableCallback = std::function<void(TorrentId, bool)>;
+	using AnnounceFunction = std::function<AnnounceResponse(
+		std::vector<std::vector<std::string>>&, const AnnounceRequest&)>;
+
+	explicit AnnounceScheduler(size_t target_peers = 50,
+							   AnnounceFunction announce = announce_tiers);
+
+	// The started event goes out on the next run_due
+	TorrentId add_torrent(std::vector<std::vector<std::string>> tiers,
+						  AnnounceRequest request);
+	void update(TorrentId id, std::int64_t uploaded, std::int64_t downloaded,
+				std::int64_t left, size_t peer_count);
+	// queue a completed event right away
+	void complete(TorrentId id);
+	// send the stopped event now and forget the torrent
+	void remove(TorrentId id);
+
+	// Sends every announce that is due; call again at next_due()
+	void run_due(Clock::time_point now = Clock::now());
+	Clock::time_point next_due() const;
+
+	PeersCallback on_peers;
+	ReachableCallback on_reachable;
+
+   private:
+	struct Torrent {
+		std::vector<std::vector<std::string>> tiers;
+		AnnounceRequest request;
+		size_t peer_count = 0;
+		std::chrono::seconds interval{0};
+		std::chrono::seconds min_interval{0};
+		Clock::time_point last_announce{};
+		Clock::time_point next_announce{};
+		int failures = 0;
+		std::uint64_t generation = 0;  // invalidates stale heap entries
+	};
+
+	struct Timer {
+		Clock::time_point when;
+		TorrentId id;
+		std::uint64_t generation;
+		bool operator>(const Timer& other) const { return when > other.when; }
+	};
+
+	void schedule(TorrentId id, Torrent& torrent, Clock::time_point when);
+	void announce(TorrentId id, Torrent& torrent, Clock::time_point now);
+	std::chrono::seconds earliest_reannounce(const Torrent& torrent) const;
+
+	size_t target_peers_;
+	AnnounceFunction announce_;
+	TorrentId next_id_ = 0;
+	std::unordered_map<TorrentId, Torrent> torrents_;
+	std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+	std::mt19937 rng_{std::random_device{}()};
+};
+
+// Runs an AnnounceScheduler for one torrent on a thread of its own, so a
+// slow or dead tracker never stalls the download loop. Progress is handed
+// over through report(); peers come back through the callback, which runs
+// on the announce thread, as does on_reachable.
+class AnnounceThread {
+   public:
+	using PeersCallback = std::function<void(const std::vector<PeerEndpoint>&)>;
+	using ReachableCallback = std::function<void(bool)>;
+
+	AnnounceThread(std::vector<std::vector<std::string>> tiers,
+				   AnnounceRequest request, PeersCallback on_peers,
+				   ReachableCallback on_reachable = {});
+	// sends the stopped event and waits for the thread
+	~AnnounceThread();
+	AnnounceThread(const AnnounceThread&) = delete;
+	AnnounceThread& operator=(const AnnounceThread&) = delete;
+
+	void report(std::int64_t downloaded, std::int64_t left, size_t peer_count);
+	void complete();
+
+   private:
+	void run(std::vector<std::vector<std::string>> tiers,
+			 AnnounceRequest request);
+
+	PeersCallback on_peers_;
+	ReachableCallback on_reachable_;
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::int64_t downloaded_ = 0;
+	std::int64_t left_ = 0;
+	size_t peer_count_ = 0;
+	bool complete_ = false;
+	bool stop_ = false;
+	std::thread thread_;
+};
+
+#endif	// ANNOUNCE_SCHEDULER_HPP
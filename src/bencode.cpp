@@ -0,0 +1,261 @@
+#include "bencode.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+json decode_bencoded_string(const std::string& encoded_value, size_t& index) {
+	// Example: "5:hello" -> "hello"
+	size_t colon_index = encoded_value.find(':', index);
+	if (colon_index != std::string::npos) {
+		std::string number_string =
+			encoded_value.substr(index, colon_index - index);
+		int64_t number = std::atoll(number_string.c_str());
+		std::string str = encoded_value.substr(colon_index + 1, number);
+		index = colon_index + number + 1;
+		return json(str);
+	} else {
+		throw std::runtime_error("Invalid encoded value: " + encoded_value);
+	}
+}
+
+json decode_bencoded_integer(const std::string& encoded_value, size_t& index) {
+	size_t end_index = encoded_value.find('e', index + 1);
+	json decoded_value =
+		json(stoll(encoded_value.substr(index + 1, end_index - index - 1)));
+	index = end_index + 1;
+	return decoded_value;
+}
+
+json decode_bencoded_list(const std::string& encoded_value, size_t& index) {
+	std::vector<json> decoded_value;
+
+	index++;  // skip first 'l'
+	while (index < encoded_value.size() - 1) {
+		if (encoded_value[index] == 'e') {
+			// list ends
+			break;
+		}
+		if (std::isdigit(encoded_value[index])) {
+			decoded_value.push_back(
+				decode_bencoded_string(encoded_value, index));
+		} else if (encoded_value[index] == 'i') {
+			decoded_value.push_back(
+				decode_bencoded_integer(encoded_value, index));
+		} else if (encoded_value[index] == 'l') {
+			decoded_value.push_back(decode_bencoded_list(encoded_value, index));
+		} else if (encoded_value[index] == 'd') {
+			// info.files is a list of dicts
+			decoded_value.push_back(decode_bencoded_dict(encoded_value, index));
+		} else {
+			throw std::runtime_error("Invalid encoded value in list");
+		}
+	}
+
+	index++;  // skip ending e
+	return json(decoded_value);
+}
+
+json decode_bencoded_dict(const std::string& encoded_value, size_t& index) {
+	json dict = json::object();
+
+	index++;  // skip leading 'd'
+	while (index < encoded_value.size() - 1) {
+		if (encoded_value[index] == 'e') {
+			// list ends
+			break;
+		}
+		json key = decode_bencoded_string(encoded_value, index);
+		json val;
+		if (std::isdigit(encoded_value[index])) {
+			val = decode_bencoded_string(encoded_value, index);
+		} else if (encoded_value[index] == 'i') {
+			val = decode_bencoded_integer(encoded_value, index);
+		} else if (encoded_value[index] == 'l') {
+			val = decode_bencoded_list(encoded_value, index);
+		} else if (encoded_value[index] == 'd') {
+			val = decode_bencoded_dict(encoded_value, index);
+		}
+
+		dict[key.get<std::string>()] = val;
+	}
+
+	index++;  // skip ending 'e'
+	return dict;
+}
+
+json decode_bencoded_value(const std::string& encoded_value) {
+	size_t index = 0;
+	if (std::isdigit(encoded_value[0])) {
+		return decode_bencoded_string(encoded_value, index);
+	} else if (encoded_value[0] == 'i') {
+		return decode_bencoded_integer(encoded_value, index);
+	} else if (encoded_value[0] == 'l') {
+		return decode_bencoded_list(encoded_value, index);
+	} else if (encoded_value[0] == 'd') {
+		return decode_bencoded_dict(encoded_value, index);
+	} else {
+		throw std::runtime_error("Unhandled encoded value: " + encoded_value);
+	}
+}
+
+std::string json_to_bencode(const json& j) {
+	std::ostringstream os;
+	if (j.is_object()) {
+		os << 'd';
+		for (auto& el : j.items()) {
+			os << el.key().size() << ':' << el.key()
+			   << json_to_bencode(el.value());
+		}
+		os << 'e';
+	} else if (j.is_array()) {
+		os << 'l';
+		for (const json& item : j) {
+			os << json_to_bencode(item);
+		}
+		os << 'e';
+	} else if (j.is_number_integer()) {
+		os << 'i' << j.get<std::int64_t>() << 'e';
+	} else if (j.is_string()) {
+		const std::string& value = j.get<std::string>();
+		os << value.size() << ':' << value;
+	}
+	return os.str();
+}
+
+namespace {
+
+// far above any tracker reply, a compact list of a million peers is 6 MB
+constexpr std::int64_t MAX_STRING_LENGTH = 64 << 20;
+
+// number * 10 + digit, or false if that does not fit in an int64_t
+bool append_digit(std::int64_t& number, char digit) {
+	if (number > (std::numeric_limits<std::int64_t>::max() - (digit - '0')) /
+					 10) {
+		return false;
+	}
+	number = number * 10 + (digit - '0');
+	return true;
+}
+
+}  // namespace
+
+void BencodeParser::feed(const char* data, size_t size) {
+	size_t i = 0;
+	while (i < size) {
+		if (done_) {
+			// whatever follows the value, like the newline some trackers
+			// append, is ignored as decode_bencoded_value does
+			return;
+		}
+		char c = data[i];
+		switch (state_) {
+			case State::value:
+				i++;
+				if (c == 'e') {
+					if (containers_.empty() ||
+						(containers_.back() && !expect_key_)) {
+						throw std::runtime_error("Unexpected end of value");
+					}
+					containers_.pop_back();
+					handler_.on_end();
+					value_complete();
+				} else if (std::isdigit(static_cast<unsigned char>(c))) {
+					state_ = State::string_length;
+					number_ = c - '0';
+				} else if (expect_key_) {
+					throw std::runtime_error("Dict key is not a string");
+				} else if (c == 'i') {
+					state_ = State::integer;
+					number_ = 0;
+					negative_ = false;
+					has_digits_ = false;
+				} else if (c == 'l' || c == 'd') {
+					containers_.push_back(c == 'd');
+					expect_key_ = c == 'd';
+					if (c == 'd') {
+						handler_.on_dict_begin();
+					} else {
+						handler_.on_list_begin();
+					}
+				} else {
+					throw std::runtime_error(
+						std::string("Unexpected bencode character: ") + c);
+				}
+				break;
+			case State::integer:
+				i++;
+				if (c == '-' && !has_digits_ && !negative_) {
+					negative_ = true;
+				} else if (std::isdigit(static_cast<unsigned char>(c))) {
+					if (!append_digit(number_, c)) {
+						throw std::runtime_error("Bencoded integer overflows");
+					}
+					has_digits_ = true;
+				} else if (c == 'e' && has_digits_) {
+					state_ = State::value;
+					handler_.on_integer(negative_ ? -number_ : number_);
+					value_complete();
+				} else {
+					throw std::runtime_error("Invalid bencoded integer");
+				}
+				break;
+			case State::string_length:
+				i++;
+				if (std::isdigit(static_cast<unsigned char>(c))) {
+					if (!append_digit(number_, c) ||
+						number_ > MAX_STRING_LENGTH) {
+						throw std::runtime_error("Bencoded string too long");
+					}
+				} else if (c == ':') {
+					state_ = State::string;
+					string_buffer_.clear();
+					if (number_ == 0) {
+						state_ = State::value;
+						emit_string({});
+					}
+				} else {
+					throw std::runtime_error("Invalid bencoded string length");
+				}
+				break;
+			case State::string: {
+				size_t wanted = number_ - string_buffer_.size();
+				size_t available = std::min(wanted, size - i);
+				if (string_buffer_.empty() && available == wanted) {
+					// whole string inside this slice, no copy needed
+					state_ = State::value;
+					i += available;
+					emit_string({data + i - available, available});
+					break;
+				}
+				string_buffer_.append(data + i, available);
+				i += available;
+				if (available == wanted) {
+					state_ = State::value;
+					emit_string(string_buffer_);
+				}
+				break;
+			}
+		}
+	}
+}
+
+void BencodeParser::emit_string(std::string_view value) {
+	if (expect_key_) {
+		handler_.on_key(value);
+		expect_key_ = false;
+		return;
+	}
+	handler_.on_string(value);
+	value_complete();
+}
+
+void BencodeParser::value_complete() {
+	done_ = containers_.empty();
+	expect_key_ = !done_ && containers_.back();
+}
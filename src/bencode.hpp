@@ -0,0 +1,67 @@
+#ifndef BENCODE_HPP
+#define BENCODE_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "lib/nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+json decode_bencoded_string(const std::string& encoded_value, size_t& index);
+json decode_bencoded_integer(const std::string& encoded_value, size_t& index);
+json decode_bencoded_list(const std::string& encoded_value, size_t& index);
+json decode_bencoded_dict(const std::string& encoded_value, size_t& index);
+json decode_bencoded_value(const std::string& encoded_value);
+
+std::string json_to_bencode(const json& j);
+
+// Callbacks of BencodeParser. Dict keys are reported through on_key, every
+// other string through on_string; on_end closes the innermost list or dict.
+class BencodeHandler {
+   public:
+	virtual ~BencodeHandler() = default;
+	virtual void on_integer(std::int64_t) {}
+	virtual void on_string(std::string_view) {}
+	virtual void on_key(std::string_view) {}
+	virtual void on_list_begin() {}
+	virtual void on_dict_begin() {}
+	virtual void on_end() {}
+};
+
+// Streaming bencode reader that never builds a tree. Input can be fed in
+// arbitrary slices; every value is reported as soon as its last byte has
+// arrived, only a string that spans slices is buffered. Bytes after the
+// top-level value are ignored. Throws std::runtime_error on malformed
+// input, on integers that do not fit in 64 bits and on strings longer
+// than 64 MB.
+class BencodeParser {
+   public:
+	explicit BencodeParser(BencodeHandler& handler) : handler_(handler) {}
+
+	void feed(const char* data, size_t size);
+	void feed(std::string_view data) { feed(data.data(), data.size()); }
+	// the top-level value is complete
+	bool done() const { return done_; }
+
+   private:
+	enum class State { value, integer, string_length, string };
+
+	void value_complete();
+	void emit_string(std::string_view value);
+
+	BencodeHandler& handler_;
+	State state_ = State::value;
+	bool done_ = false;
+	// true for a dict, false for a list
+	std::vector<bool> containers_;
+	bool expect_key_ = false;
+	bool negative_ = false;
+	bool has_digits_ = false;
+	std::int64_t number_ = 0;
+	std::string string_buffer_;
+};
+
+#endif	// BENCODE_HPP
@@ -0,0 +1,91 @@
+#include "disk_writer.hpp"
+
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+DiskWriter::DiskWriter(Storage& storage, WrittenCallback on_written)
+	: storage_(storage),
+	  on_written_(std::move(on_written)),
+	  thread_([this] { run(); }) {}
+
+DiskWriter::~DiskWriter() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	wake_.notify_one();
+	thread_.join();
+}
+
+void DiskWriter::write(std::int64_t offset, std::vector<char> data) {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		queue_.push_back({offset, std::move(data)});
+	}
+	wake_.notify_one();
+}
+
+bool DiskWriter::flush() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	idle_.wait(lock, [this] { return queue_.empty() && !writing_; });
+	return !failed_;
+}
+
+void DiskWriter::run() {
+	std::vector<Write> batch;
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true) {
+		wake_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+		if (queue_.empty()) {
+			break;
+		}
+		batch.assign(std::make_move_iterator(queue_.begin()),
+					 std::make_move_iterator(queue_.end()));
+		queue_.clear();
+		writing_ = true;
+		// after a failed write the rest is only handed back
+		bool ok = !failed_;
+		lock.unlock();
+		ok = ok && write_batch(batch);
+		for (Write& write : batch) {
+			on_written_(std::move(write.data), ok);
+		}
+		batch.clear();
+		lock.lock();
+		writing_ = false;
+		failed_ = failed_ || !ok;
+		if (queue_.empty()) {
+			idle_.notify_all();
+		}
+	}
+}
+
+// Sorted by offset, every run of adjacent pieces is one pwritev
+bool DiskWriter::write_batch(std::vector<Write>& batch) {
+	std::sort(batch.begin(), batch.end(), [](const Write& a, const Write& b) {
+		return a.offset < b.offset;
+	});
+	std::vector<iovec> iov;
+	size_t first = 0;
+	while (first < batch.size()) {
+		iov.clear();
+		std::int64_t end = batch[first].offset;
+		size_t last = first;
+		while (last < batch.size() && batch[last].offset == end) {
+			iov.push_back({batch[last].data.data(), batch[last].data.size()});
+			end += batch[last].data.size();
+			last++;
+		}
+		if (!storage_.writev(batch[first].offset, iov.data(), iov.size())) {
+			std::cerr << "Failed to write to disk: " << std::strerror(errno)
+					  << std::endl;
+			return false;
+		}
+		first = last;
+	}
+	return true;
+}
@@ -0,0 +1,57 @@
+#ifndef DISK_WRITER_HPP
+#define DISK_WRITER_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "storage.hpp"
+
+// Write-back of verified pieces on a thread of its own, so the network
+// loop never waits for the disk. Whatever queued up while the previous
+// batch was being written goes out together, pieces that are adjacent on
+// disk in a single pwritev, and every buffer is handed back through the
+// callback once written. From the first failed batch on written is false,
+// so the caller can stop instead of producing data that never lands.
+class DiskWriter {
+   public:
+	// called on the disk thread
+	using WrittenCallback =
+		std::function<void(std::vector<char>&& buffer, bool written)>;
+
+	DiskWriter(Storage& storage, WrittenCallback on_written);
+	// writes what is still queued and waits for the thread
+	~DiskWriter();
+	DiskWriter(const DiskWriter&) = delete;
+	DiskWriter& operator=(const DiskWriter&) = delete;
+
+	void write(std::int64_t offset, std::vector<char> data);
+	// Waits until everything queued is written; false if any write failed
+	bool flush();
+
+   private:
+	struct Write {
+		std::int64_t offset;
+		std::vector<char> data;
+	};
+
+	void run();
+	bool write_batch(std::vector<Write>& batch);
+
+	Storage& storage_;
+	WrittenCallback on_written_;
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable idle_;
+	std::deque<Write> queue_;
+	bool writing_ = false;
+	bool failed_ = false;
+	bool stop_ = false;
+	std::thread thread_;
+};
+
+#endif	// DISK_WRITER_HPP
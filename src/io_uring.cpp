@@ -0,0 +1,144 @@
+#ifdef BITTORRENT_IO_URING
+
+#include "io_uring.hpp"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+
+namespace {
+
+template <typename T>
+T* ring_field(void* rings, std::uint32_t offset) {
+	return reinterpret_cast<T*>(static_cast<char*>(rings) + offset);
+}
+
+}  // namespace
+
+IoUring::IoUring(unsigned entries) {
+	io_uring_params params{};
+	fd_ = syscall(__NR_io_uring_setup, entries, &params);
+	if (fd_ < 0) {
+		throw std::system_error{errno, std::system_category(),
+								"io_uring_setup"};
+	}
+	// one mapping for both rings, and timeouts passed to io_uring_enter
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+		!(params.features & IORING_FEAT_EXT_ARG)) {
+		close(fd_);
+		throw std::system_error{ENOSYS, std::system_category(),
+								"io_uring features"};
+	}
+	rings_size_ = std::max<size_t>(
+		params.sq_off.array + params.sq_entries * sizeof(unsigned),
+		params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+	rings_ = mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	if (rings_ == MAP_FAILED) {
+		int error = errno;
+		close(fd_);
+		throw std::system_error{error, std::system_category(), "mmap"};
+	}
+	sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		int error = errno;
+		munmap(rings_, rings_size_);
+		close(fd_);
+		throw std::system_error{error, std::system_category(), "mmap"};
+	}
+	sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+	sq_head_ = ring_field<unsigned>(rings_, params.sq_off.head);
+	sq_tail_ = ring_field<unsigned>(rings_, params.sq_off.tail);
+	sq_mask_ = *ring_field<unsigned>(rings_, params.sq_off.ring_mask);
+	sq_entries_ = params.sq_entries;
+	sqe_tail_ = *sq_tail_;
+	// entry i of the ring is always sqes_[i]
+	unsigned* array = ring_field<unsigned>(rings_, params.sq_off.array);
+	for (unsigned i = 0; i < sq_entries_; i++) {
+		array[i] = i;
+	}
+
+	cq_head_ = ring_field<unsigned>(rings_, params.cq_off.head);
+	cq_tail_ = ring_field<unsigned>(rings_, params.cq_off.tail);
+	cq_mask_ = *ring_field<unsigned>(rings_, params.cq_off.ring_mask);
+	cqes_ = ring_field<io_uring_cqe>(rings_, params.cq_off.cqes);
+}
+
+IoUring::~IoUring() {
+	munmap(sqes_, sqes_size_);
+	munmap(rings_, rings_size_);
+	close(fd_);
+}
+
+io_uring_sqe* IoUring::get_sqe() {
+	if (queued() >= sq_entries_ && enter(0, nullptr) < 0 &&
+		queued() >= sq_entries_) {
+		throw std::system_error{errno, std::system_category(),
+								"io_uring_enter"};
+	}
+	io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+	sqe_tail_++;
+	std::memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+bool IoUring::submit_and_wait(std::chrono::milliseconds timeout) {
+	__kernel_timespec ts{};
+	ts.tv_sec = timeout.count() / 1000;
+	ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+	if (enter(1, &ts) < 0) {
+		// a timeout or signal only ends the wait early
+		return errno == ETIME || errno == EINTR || errno == EBUSY;
+	}
+	return true;
+}
+
+bool IoUring::register_files(unsigned count) {
+	io_uring_rsrc_register files{};
+	files.nr = count;
+	files.flags = IORING_RSRC_REGISTER_SPARSE;
+	return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_FILES2,
+				   &files, sizeof(files)) == 0;
+}
+
+bool IoUring::update_file(unsigned slot, int fd) {
+	io_uring_files_update update{};
+	update.offset = slot;
+	update.fds = reinterpret_cast<std::uintptr_t>(&fd);
+	return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_FILES_UPDATE,
+				   &update, 1) == 1;
+}
+
+// Publishes the entries filled since the last call and submits them, then
+// waits for `wait` completions if asked to
+int IoUring::enter(unsigned wait, const __kernel_timespec* timeout) {
+	std::atomic_ref<unsigned>(*sq_tail_).store(sqe_tail_,
+											   std::memory_order_release);
+	if (wait == 0) {
+		return syscall(__NR_io_uring_enter, fd_, queued(), 0, 0, nullptr, 0);
+	}
+	io_uring_getevents_arg arg{};
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts = reinterpret_cast<std::uintptr_t>(timeout);
+	return syscall(__NR_io_uring_enter, fd_, queued(), wait,
+				   IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+				   sizeof(arg));
+}
+
+// entries handed out that the kernel has not consumed yet
+unsigned IoUring::queued() const {
+	return sqe_tail_ -
+		   std::atomic_ref<unsigned>(*sq_head_).load(std::memory_order_acquire);
+}
+
+#endif	// BITTORRENT_IO_URING
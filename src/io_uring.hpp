@@ -0,0 +1,77 @@
+#ifndef IO_URING_HPP
+#define IO_URING_HPP
+
+#ifdef BITTORRENT_IO_URING
+
+#include <linux/io_uring.h>
+// <linux/fs.h>, included by the line above, leaks this macro
+#undef BLOCK_SIZE
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+
+// A minimal io_uring driven with the raw syscalls, so liburing is not
+// needed. Both rings are mapped from the kernel; submission entries are
+// filled in place and published together on the next submit, completions
+// are handed out in order.
+class IoUring {
+   public:
+	// Throws std::system_error if the kernel has no usable io_uring
+	explicit IoUring(unsigned entries);
+	~IoUring();
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+
+	// A cleared entry to fill in; submits what is queued if the ring is full
+	io_uring_sqe* get_sqe();
+	// Submits everything queued and waits for a completion or the timeout
+	bool submit_and_wait(std::chrono::milliseconds timeout);
+	// Calls handler(const io_uring_cqe&) for every completion available
+	template <typename Handler>
+	void for_each_completion(Handler handler);
+
+	// An empty table of fixed files; false if the kernel cannot do it
+	bool register_files(unsigned count);
+	// Puts fd in a slot of that table, -1 empties it
+	bool update_file(unsigned slot, int fd);
+
+   private:
+	int enter(unsigned wait, const __kernel_timespec* timeout);
+	unsigned queued() const;
+
+	int fd_ = -1;
+	void* rings_ = nullptr;
+	size_t rings_size_ = 0;
+	io_uring_sqe* sqes_ = nullptr;
+	size_t sqes_size_ = 0;
+
+	unsigned* sq_head_;
+	unsigned* sq_tail_;
+	unsigned sq_mask_;
+	unsigned sq_entries_;
+	unsigned sqe_tail_ = 0;	 // entries handed out, published on submit
+
+	unsigned* cq_head_;
+	unsigned* cq_tail_;
+	unsigned cq_mask_;
+	io_uring_cqe* cqes_;
+};
+
+template <typename Handler>
+void IoUring::for_each_completion(Handler handler) {
+	unsigned head = *cq_head_;
+	while (head != std::atomic_ref<unsigned>(*cq_tail_).load(
+					   std::memory_order_acquire)) {
+		io_uring_cqe cqe = cqes_[head & cq_mask_];
+		// the slot goes back to the kernel before the handler runs, it
+		// may submit more work
+		std::atomic_ref<unsigned>(*cq_head_).store(++head,
+												   std::memory_order_release);
+		handler(cqe);
+	}
+}
+
+#endif	// BITTORRENT_IO_URING
+
+#endif	// IO_URING_HPP
@@ -23,6 +23,7 @@
 #define SHA1_HPP
 
 
+#include <algorithm>
 #include <cstdint>
 #include <fstream>
 #include <iomanip>
@@ -37,6 +38,7 @@ public:
     SHA1();
     void update(const std::string &s);
     void update(std::istream &is);
+    void update(const char *data, size_t size);
     std::string final();
     static std::string from_file(const std::string &filename);
 
@@ -273,6 +275,40 @@ inline void SHA1::update(std::istream &is)
 }
 
 
+inline void SHA1::update(const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        uint32_t block[BLOCK_INTS];
+        /* Whole blocks are transformed straight from the caller's memory */
+        if (buffer.empty() && size >= BLOCK_BYTES)
+        {
+            for (size_t i = 0; i < BLOCK_INTS; i++)
+            {
+                block[i] = (data[4*i+3] & 0xff)
+                           | (data[4*i+2] & 0xff)<<8
+                           | (data[4*i+1] & 0xff)<<16
+                           | (data[4*i+0] & 0xff)<<24;
+            }
+            transform(digest, block, transforms);
+            data += BLOCK_BYTES;
+            size -= BLOCK_BYTES;
+            continue;
+        }
+        size_t take = std::min(size, BLOCK_BYTES - buffer.size());
+        buffer.append(data, take);
+        data += take;
+        size -= take;
+        if (buffer.size() == BLOCK_BYTES)
+        {
+            buffer_to_block(buffer, block);
+            transform(digest, block, transforms);
+            buffer.clear();
+        }
+    }
+}
+
+
 /*
  * Add padding and return the message digest.
  */
@@ -178,6 +178,9 @@ namespace http
         std::vector<std::uint8_t> body;
     };
 
+    // Receives the body in the pieces it arrives in, instead of Response::body
+    using BodyHandler = std::function<void(const std::uint8_t*, std::size_t)>;
+
     inline namespace detail
     {
 #if defined(_WIN32) || defined(__CYGWIN__)
@@ -400,6 +403,12 @@ namespace http
 #endif // __APPLE__
             }
 
+            // takes ownership of an already connected non-blocking socket
+            explicit Socket(const Type adopted) noexcept:
+                endpoint{adopted}
+            {
+            }
+
             ~Socket()
             {
                 if (endpoint != invalid) close();
@@ -1110,6 +1119,218 @@ namespace http
 
             return result;
         }
+
+        // Incremental response parser, fed with whatever recv returned.
+        // The header section is buffered and the CRLFCRLF search resumes where
+        // the previous one stopped; the body is decoded in place from the fed
+        // data, so nothing is ever erased from the front of a buffer and the
+        // whole response is parsed in linear time.
+        class ResponseParser final
+        {
+        public:
+            ResponseParser() = default;
+
+            explicit ResponseParser(BodyHandler handler):
+                bodyHandler{std::move(handler)}
+            {
+            }
+
+            // returns true once the whole response has been received
+            bool feed(const std::uint8_t* data, std::size_t size)
+            {
+                if (state == State::header)
+                {
+                    const auto consumed = parseHeader(data, size);
+                    if (state == State::header) return false;
+                    data += consumed;
+                    size -= consumed;
+                }
+
+                if (state == State::identity)
+                {
+                    appendBody(data, size);
+                    // got the whole content
+                    return contentLengthReceived && bodySize >= contentLength;
+                }
+
+                return parseChunked(data, size);
+            }
+
+            Response release() noexcept
+            {
+                return std::move(response);
+            }
+
+        private:
+            enum class State
+            {
+                header,
+                identity,
+                chunkSize,
+                chunkExtension,
+                chunkSizeLf,
+                chunkData,
+                chunkDataCr,
+                chunkDataLf,
+                done
+            };
+
+            std::size_t parseHeader(const std::uint8_t* data, const std::size_t size)
+            {
+                constexpr std::array<std::uint8_t, 4> headerEnd = {'\r', '\n', '\r', '\n'};
+
+                const auto previousSize = headerData.size();
+                headerData.insert(headerData.end(), data, data + size);
+
+                // RFC 7230, 3. Message Format
+                // Empty line indicates the end of the header section (RFC 7230, 2.1. Client/Server Messaging)
+                // only the last three bytes of the previous search can start a match
+                const auto searchBegin = headerData.cbegin() +
+                    static_cast<std::ptrdiff_t>(headerScanned > 3 ? headerScanned - 3 : 0);
+                const auto endIterator = std::search(searchBegin, headerData.cend(),
+                                                     headerEnd.cbegin(), headerEnd.cend());
+                if (endIterator == headerData.cend()) // two consecutive CRLFs not found
+                {
+                    headerScanned = headerData.size();
+                    return size;
+                }
+
+                const auto headerBeginIterator = headerData.cbegin();
+                const auto headerEndIterator = endIterator + 2;
+
+                auto statusLineResult = parseStatusLine(headerBeginIterator, headerEndIterator);
+                auto i = statusLineResult.first;
+
+                response.status = std::move(statusLineResult.second);
+
+                bool chunkedResponse = false;
+
+                for (;;)
+                {
+                    auto headerFieldResult = parseHeaderField(i, headerEndIterator);
+                    i = headerFieldResult.first;
+
+                    auto fieldName = std::move(headerFieldResult.second.first);
+                    auto fieldValue = std::move(headerFieldResult.second.second);
+
+                    if (fieldName == "transfer-encoding")
+                    {
+                        // RFC 7230, 3.3.1. Transfer-Encoding
+                        if (fieldValue == "chunked")
+                            chunkedResponse = true;
+                        else
+                            throw ResponseError{"Unsupported transfer encoding: " + fieldValue};
+                    }
+                    else if (fieldName == "content-length")
+                    {
+                        // RFC 7230, 3.3.2. Content-Length
+                        contentLength = stringToUint<std::size_t>(fieldValue.cbegin(), fieldValue.cend());
+                        contentLengthReceived = true;
+                        if (!bodyHandler) response.body.reserve(contentLength);
+                    }
+
+                    response.headerFields.push_back({std::move(fieldName), std::move(fieldValue)});
+
+                    if (i == headerEndIterator)
+                        break;
+                }
+
+                // Content-Length must be ignored if Transfer-Encoding is received (RFC 7230, 3.2. Content-Length)
+                state = chunkedResponse ? State::chunkSize : State::identity;
+
+                // bytes of this call that follow the header section belong to the body
+                const auto headerSize = static_cast<std::size_t>(headerEndIterator + 2 - headerBeginIterator);
+                headerData.clear();
+                headerData.shrink_to_fit();
+                return headerSize - previousSize;
+            }
+
+            // RFC 7230, 4.1. Chunked Transfer Coding
+            bool parseChunked(const std::uint8_t* data, const std::size_t size)
+            {
+                std::size_t i = 0;
+                while (i < size)
+                {
+                    switch (state)
+                    {
+                        case State::chunkSize:
+                        {
+                            const auto c = data[i++];
+                            if (c == ';') state = State::chunkExtension;
+                            else if (c == '\r') state = State::chunkSizeLf;
+                            else if (c == '\n') state = chunkSizeEnd();
+                            else
+                            {
+                                expectedChunkSize = 16U * expectedChunkSize + hexDigitToUint<std::size_t>(c);
+                                chunkSizeDigits = true;
+                            }
+                            break;
+                        }
+                        case State::chunkExtension:
+                            if (data[i++] == '\n') state = chunkSizeEnd();
+                            break;
+                        case State::chunkSizeLf:
+                            if (data[i++] != '\n') throw ResponseError{"Invalid chunk"};
+                            state = chunkSizeEnd();
+                            break;
+                        case State::chunkData:
+                        {
+                            const auto toWrite = (std::min)(expectedChunkSize, size - i);
+                            appendBody(data + i, toWrite);
+                            i += toWrite;
+                            expectedChunkSize -= toWrite;
+                            if (expectedChunkSize == 0) state = State::chunkDataCr;
+                            break;
+                        }
+                        case State::chunkDataCr:
+                            if (data[i++] != '\r') throw ResponseError{"Invalid chunk"};
+                            state = State::chunkDataLf;
+                            break;
+                        case State::chunkDataLf:
+                            if (data[i++] != '\n') throw ResponseError{"Invalid chunk"};
+                            state = State::chunkSize;
+                            break;
+                        default:
+                            i = size;
+                            break;
+                    }
+
+                    if (state == State::done) return true;
+                }
+
+                return state == State::done;
+            }
+
+            State chunkSizeEnd()
+            {
+                if (!chunkSizeDigits) throw ResponseError{"Invalid chunk"};
+                chunkSizeDigits = false;
+                // the last chunk has zero size, trailers are not needed
+                return expectedChunkSize == 0 ? State::done : State::chunkData;
+            }
+
+            void appendBody(const std::uint8_t* data, const std::size_t size)
+            {
+                bodySize += size;
+                if (bodyHandler)
+                {
+                    if (size > 0) bodyHandler(data, size);
+                }
+                else
+                    response.body.insert(response.body.end(), data, data + size);
+            }
+
+            State state = State::header;
+            BodyHandler bodyHandler;
+            Response response;
+            std::size_t bodySize = 0U;
+            std::vector<std::uint8_t> headerData;
+            std::size_t headerScanned = 0U;
+            bool contentLengthReceived = false;
+            std::size_t contentLength = 0U;
+            std::size_t expectedChunkSize = 0U;
+            bool chunkSizeDigits = false;
+        };
     }
 
     class Request final
@@ -1122,6 +1343,23 @@ namespace http
         {
         }
 
+        // Returns a connected non-blocking socket for (host, port, timeout in
+        // milliseconds or -1), replacing the getaddrinfo and connect to the
+        // first address done by send
+        using Connector = std::function<Socket::Type(const std::string&, const std::string&, std::int64_t)>;
+
+        void setConnector(Connector newConnector)
+        {
+            connector = std::move(newConnector);
+        }
+
+        // Streams the body to the handler as it is received; the returned
+        // Response then has an empty body
+        void setBodyHandler(BodyHandler newBodyHandler)
+        {
+            bodyHandler = std::move(newBodyHandler);
+        }
+
         Response send(const std::string& method = "GET",
                       const std::string& body = "",
                       const HeaderFields& headerFields = {},
@@ -1143,35 +1381,19 @@ namespace http
             if (uri.scheme != "http")
                 throw RequestError{"Only HTTP scheme is supported"};
 
-            addrinfo hints = {};
-            hints.ai_family = getAddressFamily(internetProtocol);
-            hints.ai_socktype = SOCK_STREAM;
-
             const char* port = uri.port.empty() ? "80" : uri.port.c_str();
 
-            addrinfo* info;
-            if (getaddrinfo(uri.host.c_str(), port, &hints, &info) != 0)
-#if defined(_WIN32) || defined(__CYGWIN__)
-                throw std::system_error{WSAGetLastError(), winsock::errorCategory, "Failed to get address info of " + uri.host};
-#else
-                throw std::system_error{errno, std::system_category(), "Failed to get address info of " + uri.host};
-#endif // defined(_WIN32) || defined(__CYGWIN__)
-
-            const std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> addressInfo{info, freeaddrinfo};
-
             const auto requestData = encodeHtml(uri, method, body, headerFields);
 
-            Socket socket{internetProtocol};
-
             const auto getRemainingMilliseconds = [](const std::chrono::steady_clock::time_point time) noexcept -> std::int64_t {
                 const auto now = std::chrono::steady_clock::now();
                 const auto remainingTime = std::chrono::duration_cast<std::chrono::milliseconds>(time - now);
                 return (remainingTime.count() > 0) ? remainingTime.count() : 0;
             };
 
-            // take the first address from the list
-            socket.connect(addressInfo->ai_addr, static_cast<socklen_t>(addressInfo->ai_addrlen),
-                           (timeout.count() >= 0) ? getRemainingMilliseconds(stopTime) : -1);
+            Socket socket = connector ?
+                Socket{connector(uri.host, port, (timeout.count() >= 0) ? getRemainingMilliseconds(stopTime) : -1)} :
+                connect(port, timeout, stopTime, getRemainingMilliseconds);
 
             auto remaining = requestData.size();
             auto sendData = requestData.data();
@@ -1185,17 +1407,8 @@ namespace http
                 sendData += size;
             }
 
-            std::array<std::uint8_t, 4096> tempBuffer;
-            constexpr std::array<std::uint8_t, 2> crlf = {'\r', '\n'};
-            constexpr std::array<std::uint8_t, 4> headerEnd = {'\r', '\n', '\r', '\n'};
-            Response response;
-            std::vector<std::uint8_t> responseData;
-            bool parsingBody = false;
-            bool contentLengthReceived = false;
-            std::size_t contentLength = 0U;
-            bool chunkedResponse = false;
-            std::size_t expectedChunkSize = 0U;
-            bool removeCrlfAfterChunk = false;
+            std::array<std::uint8_t, 16384> tempBuffer;
+            ResponseParser parser{bodyHandler};
 
             // read the response
             for (;;)
@@ -1203,127 +1416,50 @@ namespace http
                 const auto size = socket.recv(tempBuffer.data(), tempBuffer.size(),
                                               (timeout.count() >= 0) ? getRemainingMilliseconds(stopTime) : -1);
                 if (size == 0) // disconnected
-                    return response;
-
-                responseData.insert(responseData.end(), tempBuffer.begin(), tempBuffer.begin() + size);
-
-                if (!parsingBody)
-                {
-                    // RFC 7230, 3. Message Format
-                    // Empty line indicates the end of the header section (RFC 7230, 2.1. Client/Server Messaging)
-                    const auto endIterator = std::search(responseData.cbegin(), responseData.cend(),
-                                                         headerEnd.cbegin(), headerEnd.cend());
-                    if (endIterator == responseData.cend()) break; // two consecutive CRLFs not found
-
-                    const auto headerBeginIterator = responseData.cbegin();
-                    const auto headerEndIterator = endIterator + 2;
-
-                    auto statusLineResult = parseStatusLine(headerBeginIterator, headerEndIterator);
-                    auto i = statusLineResult.first;
-
-                    response.status = std::move(statusLineResult.second);
-
-                    for (;;)
-                    {
-                        auto headerFieldResult = parseHeaderField(i, headerEndIterator);
-                        i = headerFieldResult.first;
-
-                        auto fieldName = std::move(headerFieldResult.second.first);
-                        auto fieldValue = std::move(headerFieldResult.second.second);
-
-                        if (fieldName == "transfer-encoding")
-                        {
-                            // RFC 7230, 3.3.1. Transfer-Encoding
-                            if (fieldValue == "chunked")
-                                chunkedResponse = true;
-                            else
-                                throw ResponseError{"Unsupported transfer encoding: " + fieldValue};
-                        }
-                        else if (fieldName == "content-length")
-                        {
-                            // RFC 7230, 3.3.2. Content-Length
-                            contentLength = stringToUint<std::size_t>(fieldValue.cbegin(), fieldValue.cend());
-                            contentLengthReceived = true;
-                            response.body.reserve(contentLength);
-                        }
-
-                        response.headerFields.push_back({std::move(fieldName), std::move(fieldValue)});
-
-                        if (i == headerEndIterator)
-                            break;
-                    }
-
-                    responseData.erase(responseData.cbegin(), headerEndIterator + 2);
-                    parsingBody = true;
-                }
-
-                if (parsingBody)
-                {
-                    // Content-Length must be ignored if Transfer-Encoding is received (RFC 7230, 3.2. Content-Length)
-                    if (chunkedResponse)
-                    {
-                        // RFC 7230, 4.1. Chunked Transfer Coding
-                        for (;;)
-                        {
-                            if (expectedChunkSize > 0)
-                            {
-                                const auto toWrite = (std::min)(expectedChunkSize, responseData.size());
-                                response.body.insert(response.body.end(), responseData.begin(),
-                                                     responseData.begin() + static_cast<std::ptrdiff_t>(toWrite));
-                                responseData.erase(responseData.begin(),
-                                                   responseData.begin() + static_cast<std::ptrdiff_t>(toWrite));
-                                expectedChunkSize -= toWrite;
-
-                                if (expectedChunkSize == 0) removeCrlfAfterChunk = true;
-                                if (responseData.empty()) break;
-                            }
-                            else
-                            {
-                                if (removeCrlfAfterChunk)
-                                {
-                                    if (responseData.size() < 2) break;
-                                    
-                                    if (!std::equal(crlf.begin(), crlf.end(), responseData.begin()))
-                                        throw ResponseError{"Invalid chunk"};
+                    return parser.release();
 
-                                    removeCrlfAfterChunk = false;
-                                    responseData.erase(responseData.begin(), responseData.begin() + 2);
-                                }
+                if (parser.feed(tempBuffer.data(), size))
+                    return parser.release();
+            }
+        }
 
-                                const auto i = std::search(responseData.begin(), responseData.end(),
-                                                           crlf.begin(), crlf.end());
+    private:
+        template <class RemainingMilliseconds>
+        Socket connect(const char* port,
+                       const std::chrono::milliseconds timeout,
+                       const std::chrono::steady_clock::time_point stopTime,
+                       RemainingMilliseconds getRemainingMilliseconds)
+        {
+            addrinfo hints = {};
+            hints.ai_family = getAddressFamily(internetProtocol);
+            hints.ai_socktype = SOCK_STREAM;
 
-                                if (i == responseData.end()) break;
+            addrinfo* info;
+            if (getaddrinfo(uri.host.c_str(), port, &hints, &info) != 0)
+#if defined(_WIN32) || defined(__CYGWIN__)
+                throw std::system_error{WSAGetLastError(), winsock::errorCategory, "Failed to get address info of " + uri.host};
+#else
+                throw std::system_error{errno, std::system_category(), "Failed to get address info of " + uri.host};
+#endif // defined(_WIN32) || defined(__CYGWIN__)
 
-                                expectedChunkSize = detail::hexStringToUint<std::size_t>(responseData.begin(), i);
-                                responseData.erase(responseData.begin(), i + 2);
+            const std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> addressInfo{info, freeaddrinfo};
 
-                                if (expectedChunkSize == 0)
-                                    return response;
-                            }
-                        }
-                    }
-                    else
-                    {
-                        response.body.insert(response.body.end(), responseData.begin(), responseData.end());
-                        responseData.clear();
+            Socket socket{internetProtocol};
 
-                        // got the whole content
-                        if (contentLengthReceived && response.body.size() >= contentLength)
-                            return response;
-                    }
-                }
-            }
+            // take the first address from the list
+            socket.connect(addressInfo->ai_addr, static_cast<socklen_t>(addressInfo->ai_addrlen),
+                           (timeout.count() >= 0) ? getRemainingMilliseconds(stopTime) : -1);
 
-            return response;
+            return socket;
         }
 
-    private:
 #if defined(_WIN32) || defined(__CYGWIN__)
         winsock::Api winSock;
 #endif // defined(_WIN32) || defined(__CYGWIN__)
         InternetProtocol internetProtocol;
         Uri uri;
+        Connector connector;
+        BodyHandler bodyHandler;
     };
 }
 
@@ -0,0 +1,163 @@
+#include "message_reader.hpp"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "wire.hpp"
+
+namespace {
+
+constexpr size_t INITIAL_BUFFER = 65536;
+// never hand recv less room than this
+constexpr size_t MIN_READ = 16384;
+
+}  // namespace
+
+MessageReader::MessageReader(size_t max_message_length)
+	: buffer_(INITIAL_BUFFER), max_message_length_(max_message_length) {}
+
+MessageReader::Status MessageReader::receive(int fd, size_t& budget) {
+	while (budget > 0) {
+		if (payload_ && payload_received_ == payload_length_) {
+			return Status::more;
+		}
+		iovec iov[2];
+		int iov_count = read_vectors(iov);
+		size_t room = 0;
+		for (int i = 0; i < iov_count; i++) {
+			room += iov[i].iov_len;
+		}
+		ssize_t received = readv(fd, iov, iov_count);
+		if (received > 0) {
+			budget -= std::min<size_t>(budget, received);
+			if (commit_read(received)) {
+				return Status::more;
+			}
+			// a short read means the socket is drained, skip the EAGAIN
+			if ((size_t)received < room) {
+				break;
+			}
+		} else if (received == 0) {
+			return Status::closed;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
+		} else if (errno != EINTR) {
+			return Status::error;
+		}
+	}
+	return Status::ok;
+}
+
+int MessageReader::read_vectors(iovec (&iov)[2]) {
+	make_room();
+	if (payload_) {
+		// the rest of the payload, then just enough for the next header so
+		// that its payload can go in place as well
+		iov[0] = {payload_ + payload_received_,
+				  payload_length_ - payload_received_};
+		iov[1] = {buffer_.data() + end_, PIECE_HEADER_LENGTH};
+		return 2;
+	}
+	iov[0] = {buffer_.data() + end_, buffer_.size() - end_};
+	return 1;
+}
+
+bool MessageReader::commit_read(size_t length) {
+	size_t to_payload = payload_ ? payload_length_ - payload_received_ : 0;
+	size_t into_payload = std::min(length, to_payload);
+	payload_received_ += into_payload;
+	end_ += length - into_payload;
+	return payload_ && payload_received_ == payload_length_;
+}
+
+const char* MessageReader::handshake() {
+	if (buffered() < wire::HANDSHAKE_LENGTH) {
+		return nullptr;
+	}
+	const char* handshake = buffer_.data() + begin_;
+	begin_ += wire::HANDSHAKE_LENGTH;
+	return handshake;
+}
+
+bool MessageReader::next(const char*& message, size_t& length,
+						 const BlockSink& sink) {
+	if (payload_) {
+		if (payload_received_ < payload_length_) {
+			return false;
+		}
+		payload_ = nullptr;
+		message = piece_header_;
+		length = sizeof(piece_header_) + payload_length_;
+		return true;
+	}
+	while (buffered() >= 4) {
+		std::uint32_t message_length =
+			wire::read_uint32(buffer_.data() + begin_);
+		if (message_length > max_message_length_) {
+			failed_ = true;
+			return false;
+		}
+		if (message_length == 0) {
+			begin_ += 4;
+			continue;
+		}
+		// the message id decides how the rest is read
+		if (buffered() < 5) {
+			return false;
+		}
+		const char* body = buffer_.data() + begin_ + 4;
+		if (body[0] == wire::piece && message_length >= sizeof(piece_header_)) {
+			if (buffered() < PIECE_HEADER_LENGTH) {
+				return false;
+			}
+			std::memcpy(piece_header_, body, sizeof(piece_header_));
+			payload_length_ = message_length - sizeof(piece_header_);
+			payload_ = sink(wire::read_uint32(piece_header_ + 1),
+							wire::read_uint32(piece_header_ + 5),
+							payload_length_);
+			if (!payload_) {
+				discard_.resize(payload_length_);
+				payload_ = discard_.data();
+			}
+			// whatever of the payload came with the header is copied, the
+			// rest is read into place by receive()
+			payload_received_ = std::min(buffered() - PIECE_HEADER_LENGTH,
+										 payload_length_);
+			std::memcpy(payload_, body + sizeof(piece_header_),
+						payload_received_);
+			begin_ += PIECE_HEADER_LENGTH + payload_received_;
+			return next(message, length, sink);
+		}
+		if (buffered() - 4 < message_length) {
+			return false;
+		}
+		message = body;
+		length = message_length;
+		begin_ += 4 + message_length;
+		return true;
+	}
+	return false;
+}
+
+// Moves the unread bytes to the front, or grows the buffer when they
+// already fill most of it (a message larger than the buffer)
+void MessageReader::make_room() {
+	if (begin_ == end_) {
+		begin_ = end_ = 0;
+	}
+	if (buffer_.size() - end_ >= MIN_READ) {
+		return;
+	}
+	if (begin_ > 0) {
+		std::memmove(buffer_.data(), buffer_.data() + begin_, buffered());
+		end_ -= begin_;
+		begin_ = 0;
+	}
+	if (buffer_.size() - end_ < MIN_READ) {
+		buffer_.resize(buffer_.size() * 2);
+	}
+}
@@ -0,0 +1,76 @@
+#ifndef MESSAGE_READER_HPP
+#define MESSAGE_READER_HPP
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Frames the byte stream of one peer connection: the 68-byte handshake,
+// then length-prefixed messages. receive() pulls whatever the socket holds
+// into a per-connection buffer, normally with a single recv, and next()
+// hands out every complete message in it, so a partial read never stalls
+// the connection and a burst of small messages costs one syscall.
+//
+// PIECE payloads skip the buffer: as soon as the 13-byte header is in,
+// the sink names the final location of the block and the rest of the
+// payload is read straight there, together with the next message header
+// in the same readv. Once a transfer is streaming every block lands in
+// place without being copied in user space.
+class MessageReader {
+   public:
+	enum class Status {
+		ok,
+		more,  // a PIECE payload completed, call next() and receive again
+		closed,
+		error
+	};
+	// Where the payload of a PIECE goes; nullptr drops it
+	using BlockSink = std::function<char*(
+		std::uint32_t piece, std::uint32_t begin, std::uint32_t length)>;
+
+	explicit MessageReader(size_t max_message_length);
+
+	// Reads until the socket is drained or the budget is used up
+	Status receive(int fd, size_t& budget);
+
+	// For callers that do the read themselves (io_uring): the buffers the
+	// next read fills, and how much it put there. commit_read() returns
+	// true when a PIECE payload completed.
+	int read_vectors(iovec (&iov)[2]);
+	bool commit_read(size_t length);
+
+	// The handshake once all of it is buffered, nullptr until then
+	const char* handshake();
+
+	// Next complete message, id first; keep-alives are skipped. For a
+	// PIECE only the 9 header bytes are readable, the payload went to the
+	// sink. Returns false when more bytes are needed or the peer announced
+	// a message longer than allowed, which failed() then reports. The data
+	// stays valid until the next receive().
+	bool next(const char*& message, size_t& length, const BlockSink& sink);
+	bool failed() const { return failed_; }
+
+   private:
+	static constexpr size_t PIECE_HEADER_LENGTH = 13;
+
+	size_t buffered() const { return end_ - begin_; }
+	void make_room();
+
+	std::vector<char> buffer_;
+	size_t begin_ = 0;
+	size_t end_ = 0;
+	size_t max_message_length_;
+	bool failed_ = false;
+
+	// the PIECE whose payload is being read into place
+	char* payload_ = nullptr;
+	size_t payload_length_ = 0;
+	size_t payload_received_ = 0;
+	char piece_header_[9];
+	std::vector<char> discard_;	 // payloads the sink did not want
+};
+
+#endif	// MESSAGE_READER_HPP
@@ -0,0 +1,317 @@
+#include "mock_tracker.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <array>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
+
+#include "bencode.hpp"
+
+namespace {
+
+constexpr std::uint32_t ACTION_CONNECT = 0;
+constexpr std::uint32_t ACTION_ANNOUNCE = 1;
+constexpr std::uint32_t ACTION_SCRAPE = 2;
+constexpr std::uint32_t ACTION_ERROR = 3;
+
+std::uint32_t get_u32(const std::uint8_t* data) {
+	return std::uint32_t(data[0]) << 24 | std::uint32_t(data[1]) << 16 |
+		   std::uint32_t(data[2]) << 8 | std::uint32_t(data[3]);
+}
+
+void put_u32(std::string& packet, std::uint32_t value) {
+	for (int shift = 24; shift >= 0; shift -= 8) {
+		packet.push_back(value >> shift);
+	}
+}
+
+std::string encode_compact_peers(const std::vector<PeerEndpoint>& peers,
+								 std::uint8_t family) {
+	std::string compact;
+	size_t address_size = family == AF_INET6 ? 16 : 4;
+	for (const PeerEndpoint& peer : peers) {
+		if (peer.family != family) {
+			continue;
+		}
+		compact.append(reinterpret_cast<const char*>(peer.address.data()),
+					   address_size);
+		compact.push_back(peer.port >> 8);
+		compact.push_back(peer.port);
+	}
+	return compact;
+}
+
+int bind_socket(const std::string& host, int port, int type) {
+	int fd = socket(AF_INET, type, 0);
+	int reuse = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	inet_pton(AF_INET, host.c_str(), &address.sin_addr);
+	if (fd < 0 ||
+		bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+		throw std::runtime_error("Failed to bind " + host + ":" +
+								 std::to_string(port));
+	}
+	return fd;
+}
+
+class DropDecider {
+   public:
+	explicit DropDecider(double rate) : rate_(rate) {}
+
+	bool drop() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return rate_ > 0 && distribution_(rng_) < rate_;
+	}
+
+   private:
+	double rate_;
+	std::mutex mutex_;
+	std::mt19937 rng_{std::random_device{}()};
+	std::uniform_real_distribution<double> distribution_{0, 1};
+};
+
+int hex_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+std::string url_decode(const std::string& input) {
+	std::string decoded;
+	for (size_t i = 0; i < input.size(); i++) {
+		if (input[i] == '%' && i + 2 < input.size() &&
+			hex_value(input[i + 1]) >= 0 && hex_value(input[i + 2]) >= 0) {
+			decoded.push_back(hex_value(input[i + 1]) * 16 +
+							  hex_value(input[i + 2]));
+			i += 2;
+		} else {
+			decoded.push_back(input[i] == '+' ? ' ' : input[i]);
+		}
+	}
+	return decoded;
+}
+
+std::string http_reply(const MockTrackerOptions& options,
+					   const std::string& target) {
+	size_t query_index = target.find('?');
+	std::string path = target.substr(0, query_index);
+	std::vector<std::string> info_hashes;
+	if (query_index != std::string::npos) {
+		std::string query = target.substr(query_index + 1);
+		for (size_t begin = 0; begin <= query.size();) {
+			size_t end = std::min(query.find('&', begin), query.size());
+			std::string parameter = query.substr(begin, end - begin);
+			if (parameter.starts_with("info_hash=")) {
+				info_hashes.push_back(url_decode(parameter.substr(10)));
+			}
+			begin = end + 1;
+		}
+	}
+
+	json reply = json::object();
+	if (!options.failure_reason.empty()) {
+		reply["failure reason"] = options.failure_reason;
+	} else if (path.ends_with("/scrape")) {
+		json files = json::object();
+		for (const std::string& info_hash : info_hashes) {
+			files[info_hash] = {
+				{"complete", static_cast<std::int64_t>(options.peers.size())},
+				{"downloaded", 0},
+				{"incomplete", 0}};
+		}
+		reply["files"] = files;
+	} else {
+		reply["interval"] = options.interval;
+		if (options.min_interval > 0) {
+			reply["min interval"] = options.min_interval;
+		}
+		reply["complete"] = static_cast<std::int64_t>(options.peers.size());
+		reply["incomplete"] = 0;
+		reply["peers"] = encode_compact_peers(options.peers, AF_INET);
+		std::string peers6 = encode_compact_peers(options.peers, AF_INET6);
+		if (!peers6.empty()) {
+			reply["peers6"] = peers6;
+		}
+	}
+	return json_to_bencode(reply);
+}
+
+void serve_http_connection(int fd, const MockTrackerOptions& options,
+						   DropDecider& drops) {
+	std::string request;
+	std::array<char, 4096> buffer;
+	while (request.find("\r\n\r\n") == std::string::npos) {
+		ssize_t length = recv(fd, buffer.data(), buffer.size(), 0);
+		if (length <= 0) {
+			close(fd);
+			return;
+		}
+		request.append(buffer.data(), length);
+	}
+	std::this_thread::sleep_for(options.delay);
+	if (drops.drop()) {
+		close(fd);
+		return;
+	}
+	// "GET <target> HTTP/1.1"
+	size_t target_begin = request.find(' ') + 1;
+	size_t target_end = request.find(' ', target_begin);
+	std::string body =
+		http_reply(options, request.substr(target_begin, target_end - target_begin));
+	std::string response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+						   "Content-Length: " +
+						   std::to_string(body.size()) + "\r\n\r\n" + body;
+	for (size_t sent = 0; sent < response.size();) {
+		ssize_t length = send(fd, response.data() + sent,
+							  response.size() - sent, MSG_NOSIGNAL);
+		if (length <= 0) {
+			break;
+		}
+		sent += length;
+	}
+	close(fd);
+}
+
+}  // namespace
+
+void run_mock_udp_tracker(const MockTrackerOptions& options) {
+	int fd = bind_socket(options.host, options.udp_port, SOCK_DGRAM);
+	std::string compact_peers = encode_compact_peers(options.peers, AF_INET);
+	std::mt19937_64 rng{std::random_device{}()};
+	std::unordered_set<std::uint64_t> connection_ids;
+	DropDecider drops(options.drop_rate);
+	std::cout << "UDP tracker listening on " << options.host << ":"
+			  << options.udp_port << std::endl;
+
+	// replies wait here until their delay has passed; the delay is the
+	// same for all of them, so the queue stays in send order
+	struct PendingReply {
+		std::chrono::steady_clock::time_point when;
+		sockaddr_storage client;
+		socklen_t client_length;
+		std::string reply;
+	};
+	std::deque<PendingReply> pending;
+
+	std::array<std::uint8_t, 2048> buffer;
+	for (;;) {
+		int timeout = -1;
+		if (!pending.empty()) {
+			auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+				pending.front().when - std::chrono::steady_clock::now());
+			timeout = std::max<std::int64_t>(wait.count(), 0);
+		}
+		pollfd pfd{fd, POLLIN, 0};
+		poll(&pfd, 1, timeout);
+
+		auto now = std::chrono::steady_clock::now();
+		while (!pending.empty() && pending.front().when <= now) {
+			const PendingReply& reply = pending.front();
+			sendto(fd, reply.reply.data(), reply.reply.size(), 0,
+				   reinterpret_cast<const sockaddr*>(&reply.client),
+				   reply.client_length);
+			pending.pop_front();
+		}
+		if (!(pfd.revents & POLLIN)) {
+			continue;
+		}
+
+		sockaddr_storage client;
+		socklen_t client_length = sizeof(client);
+		ssize_t length =
+			recvfrom(fd, buffer.data(), buffer.size(), MSG_DONTWAIT,
+					 reinterpret_cast<sockaddr*>(&client), &client_length);
+		if (length < 16 || drops.drop()) {
+			continue;
+		}
+		std::uint64_t connection_id =
+			std::uint64_t(get_u32(buffer.data())) << 32 |
+			get_u32(buffer.data() + 4);
+		std::uint32_t action = get_u32(buffer.data() + 8);
+		std::uint32_t transaction_id = get_u32(buffer.data() + 12);
+
+		std::string reply;
+		if (action == ACTION_CONNECT) {
+			std::uint64_t new_id = rng();
+			connection_ids.insert(new_id);
+			put_u32(reply, ACTION_CONNECT);
+			put_u32(reply, transaction_id);
+			put_u32(reply, new_id >> 32);
+			put_u32(reply, new_id);
+		} else if (!connection_ids.contains(connection_id)) {
+			put_u32(reply, ACTION_ERROR);
+			put_u32(reply, transaction_id);
+			reply += "unknown connection id";
+		} else if (!options.failure_reason.empty()) {
+			put_u32(reply, ACTION_ERROR);
+			put_u32(reply, transaction_id);
+			reply += options.failure_reason;
+		} else if (action == ACTION_ANNOUNCE && length >= 98) {
+			put_u32(reply, ACTION_ANNOUNCE);
+			put_u32(reply, transaction_id);
+			put_u32(reply, options.interval);
+			put_u32(reply, 0);	// leechers
+			put_u32(reply, options.peers.size());  // seeders
+			reply += compact_peers;
+		} else if (action == ACTION_SCRAPE) {
+			put_u32(reply, ACTION_SCRAPE);
+			put_u32(reply, transaction_id);
+			for (ssize_t offset = 16; offset + 20 <= length; offset += 20) {
+				put_u32(reply, options.peers.size());  // seeders
+				put_u32(reply, 0);					   // completed
+				put_u32(reply, 0);					   // leechers
+			}
+		} else {
+			put_u32(reply, ACTION_ERROR);
+			put_u32(reply, transaction_id);
+			reply += "unsupported action";
+		}
+		pending.push_back({now + options.delay, client, client_length,
+						   std::move(reply)});
+	}
+}
+
+void run_mock_http_tracker(const MockTrackerOptions& options) {
+	int fd = bind_socket(options.host, options.http_port, SOCK_STREAM);
+	if (listen(fd, SOMAXCONN) < 0) {
+		throw std::runtime_error("Failed to listen on HTTP tracker socket");
+	}
+	DropDecider drops(options.drop_rate);
+	std::cout << "HTTP tracker listening on http://" << options.host << ":"
+			  << options.http_port << "/announce" << std::endl;
+	for (;;) {
+		int client = accept(fd, nullptr, nullptr);
+		if (client < 0) {
+			continue;
+		}
+		// one thread per request keeps the configured delay per request
+		std::thread(serve_http_connection, client, std::cref(options),
+					std::ref(drops))
+			.detach();
+	}
+}
+
+void run_mock_tracker(const MockTrackerOptions& options) {
+	if (options.http_port != 0 && options.udp_port != 0) {
+		std::thread(run_mock_udp_tracker, std::cref(options)).detach();
+		run_mock_http_tracker(options);
+	} else if (options.http_port != 0) {
+		run_mock_http_tracker(options);
+	} else {
+		run_mock_udp_tracker(options);
+	}
+}
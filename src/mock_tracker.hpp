@@ -0,0 +1,35 @@
+#ifndef MOCK_TRACKER_HPP
+#define MOCK_TRACKER_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "peer_endpoint.hpp"
+
+// Stand-in tracker on loopback so announces, scrapes and downloads can be
+// exercised offline with repeatable peer lists, latency and failures
+struct MockTrackerOptions {
+	std::string host = "127.0.0.1";
+	int http_port = 0;	// 0: no HTTP tracker
+	int udp_port = 0;	// 0: no UDP tracker
+	std::vector<PeerEndpoint> peers;  // returned on every announce
+	std::int64_t interval = 1800;
+	std::int64_t min_interval = 0;
+	// added before every reply
+	std::chrono::milliseconds delay{0};
+	// when set, every announce and scrape fails with this reason
+	std::string failure_reason;
+	// share of requests left unanswered, 0 to 1
+	double drop_rate = 0;
+};
+
+// Serves BEP 15 connect, announce and scrape requests, never returns
+void run_mock_udp_tracker(const MockTrackerOptions& options);
+// Serves /announce and /scrape over HTTP, never returns
+void run_mock_http_tracker(const MockTrackerOptions& options);
+// Both of the above as configured, never returns
+void run_mock_tracker(const MockTrackerOptions& options);
+
+#endif	// MOCK_TRACKER_HPP
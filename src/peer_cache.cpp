@@ -0,0 +1,177 @@
+#include "peer_cache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include "util.hpp"
+
+namespace {
+
+constexpr char MAGIC[4] = {'B', 'T', 'P', 'C'};
+constexpr std::uint8_t VERSION = 1;
+// family, address, port, last seen, throughput, successes, failures
+constexpr size_t RECORD_SIZE = 1 + 16 + 2 + 8 + 4 + 2 + 2;
+constexpr size_t MAX_PEERS = 200;
+constexpr std::int64_t MAX_AGE_SECONDS = 7 * 24 * 3600;
+
+std::int64_t unix_now() {
+	return std::chrono::duration_cast<std::chrono::seconds>(
+			   std::chrono::system_clock::now().time_since_epoch())
+		.count();
+}
+
+// fields are stored little-endian
+template <typename T>
+void put(char*& out, T value) {
+	for (size_t i = 0; i < sizeof(T); i++) {
+		*out++ = static_cast<char>(static_cast<std::uint64_t>(value) >> (8 * i));
+	}
+}
+
+template <typename T>
+T get(const char*& in) {
+	std::uint64_t value = 0;
+	for (size_t i = 0; i < sizeof(T); i++) {
+		value |= std::uint64_t(static_cast<std::uint8_t>(*in++)) << (8 * i);
+	}
+	return static_cast<T>(value);
+}
+
+double success_rate(const CachedPeer& peer) {
+	return (peer.handshake_successes + 1.0) /
+		   (peer.handshake_successes + peer.handshake_failures + 2.0);
+}
+
+}  // namespace
+
+PeerCache::PeerCache(const std::string& info_hash) {
+	std::filesystem::path dir = std::filesystem::path(get_cache_dir()) / "peers";
+	std::error_code ec;
+	std::filesystem::create_directories(dir, ec);
+	path_ = (dir / byte_string_to_hex(info_hash)).string();
+
+	std::ifstream file(path_, std::ios::binary);
+	char header[sizeof(MAGIC) + 1 + 4];
+	if (!file.read(header, sizeof(header)) ||
+		std::memcmp(header, MAGIC, sizeof(MAGIC)) != 0 ||
+		header[sizeof(MAGIC)] != VERSION) {
+		return;
+	}
+	const char* in = header + sizeof(MAGIC) + 1;
+	std::uint32_t count = get<std::uint32_t>(in);
+	std::vector<char> records(std::min<size_t>(count, MAX_PEERS) * RECORD_SIZE);
+	file.read(records.data(), records.size());
+	size_t complete = file.gcount() / RECORD_SIZE;
+	in = records.data();
+	std::int64_t oldest = unix_now() - MAX_AGE_SECONDS;
+	for (size_t i = 0; i < complete; i++) {
+		CachedPeer peer;
+		peer.endpoint.family = get<std::uint8_t>(in);
+		std::memcpy(peer.endpoint.address.data(), in, 16);
+		in += 16;
+		peer.endpoint.port = get<std::uint16_t>(in);
+		peer.last_seen = get<std::int64_t>(in);
+		peer.throughput = get<std::uint32_t>(in);
+		peer.handshake_successes = get<std::uint16_t>(in);
+		peer.handshake_failures = get<std::uint16_t>(in);
+		if (peer.last_seen >= oldest) {
+			peers_.push_back(peer);
+		}
+	}
+}
+
+std::vector<PeerEndpoint> PeerCache::best_peers(size_t count) const {
+	std::vector<const CachedPeer*> ranked;
+	for (const CachedPeer& peer : peers_) {
+		if (peer.handshake_successes > 0) {
+			ranked.push_back(&peer);
+		}
+	}
+	std::sort(ranked.begin(), ranked.end(),
+			  [](const CachedPeer* a, const CachedPeer* b) {
+				  double rate_a = success_rate(*a), rate_b = success_rate(*b);
+				  if (rate_a != rate_b) {
+					  return rate_a > rate_b;
+				  }
+				  if (a->throughput != b->throughput) {
+					  return a->throughput > b->throughput;
+				  }
+				  return a->last_seen > b->last_seen;
+			  });
+	std::vector<PeerEndpoint> best;
+	for (size_t i = 0; i < ranked.size() && i < count; i++) {
+		best.push_back(ranked[i]->endpoint);
+	}
+	return best;
+}
+
+void PeerCache::record_handshake(const PeerEndpoint& endpoint, bool ok) {
+	CachedPeer& peer = find_or_add(endpoint);
+	if (ok) {
+		peer.last_seen = unix_now();
+		peer.handshake_successes =
+			std::min<int>(peer.handshake_successes + 1, UINT16_MAX);
+	} else {
+		peer.handshake_failures =
+			std::min<int>(peer.handshake_failures + 1, UINT16_MAX);
+	}
+}
+
+void PeerCache::record_throughput(const PeerEndpoint& endpoint,
+								  std::uint32_t bytes_per_second) {
+	find_or_add(endpoint).throughput = bytes_per_second;
+}
+
+void PeerCache::save() const {
+	std::vector<const CachedPeer*> kept;
+	for (const CachedPeer& peer : peers_) {
+		if (peer.last_seen > 0) {
+			kept.push_back(&peer);
+		}
+	}
+	std::sort(kept.begin(), kept.end(),
+			  [](const CachedPeer* a, const CachedPeer* b) {
+				  return a->last_seen > b->last_seen;
+			  });
+	kept.resize(std::min(kept.size(), MAX_PEERS));
+
+	std::vector<char> data(sizeof(MAGIC) + 1 + 4 + kept.size() * RECORD_SIZE);
+	char* out = data.data();
+	std::memcpy(out, MAGIC, sizeof(MAGIC));
+	out += sizeof(MAGIC);
+	put<std::uint8_t>(out, VERSION);
+	put<std::uint32_t>(out, kept.size());
+	for (const CachedPeer* peer : kept) {
+		put<std::uint8_t>(out, peer->endpoint.family);
+		std::memcpy(out, peer->endpoint.address.data(), 16);
+		out += 16;
+		put<std::uint16_t>(out, peer->endpoint.port);
+		put<std::int64_t>(out, peer->last_seen);
+		put<std::uint32_t>(out, peer->throughput);
+		put<std::uint16_t>(out, peer->handshake_successes);
+		put<std::uint16_t>(out, peer->handshake_failures);
+	}
+
+	std::string tmp_path = path_ + ".tmp";
+	std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+	file.write(data.data(), data.size());
+	file.close();
+	if (file) {
+		std::rename(tmp_path.c_str(), path_.c_str());
+	}
+}
+
+CachedPeer& PeerCache::find_or_add(const PeerEndpoint& endpoint) {
+	auto it = std::find_if(
+		peers_.begin(), peers_.end(),
+		[&](const CachedPeer& peer) { return peer.endpoint == endpoint; });
+	if (it != peers_.end()) {
+		return *it;
+	}
+	peers_.push_back({endpoint});
+	return peers_.back();
+}
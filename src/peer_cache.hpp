@@ -0,0 +1,42 @@
+#ifndef PEER_CACHE_HPP
+#define PEER_CACHE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "peer_endpoint.hpp"
+
+struct CachedPeer {
+	PeerEndpoint endpoint;
+	std::int64_t last_seen = 0;		  // unix time of the last handshake
+	std::uint32_t throughput = 0;	  // bytes per second, last measured
+	std::uint16_t handshake_successes = 0;
+	std::uint16_t handshake_failures = 0;
+};
+
+// Peers that worked for one torrent, kept between runs in a small binary
+// file in the cache directory so a restart can dial them right away
+// instead of waiting for the tracker.
+class PeerCache {
+   public:
+	explicit PeerCache(const std::string& info_hash);
+
+	// best first: handshake success rate, then throughput, then recency
+	std::vector<PeerEndpoint> best_peers(size_t count) const;
+
+	void record_handshake(const PeerEndpoint& endpoint, bool ok);
+	void record_throughput(const PeerEndpoint& endpoint,
+						   std::uint32_t bytes_per_second);
+
+	// Replaces the file atomically, keeping the most recent peers
+	void save() const;
+
+   private:
+	CachedPeer& find_or_add(const PeerEndpoint& endpoint);
+
+	std::string path_;
+	std::vector<CachedPeer> peers_;
+};
+
+#endif	// PEER_CACHE_HPP
@@ -0,0 +1,123 @@
+#include "peer_endpoint.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <cstring>
+
+socklen_t PeerEndpoint::to_sockaddr(sockaddr_storage& storage) const {
+	storage = {};
+	if (family == AF_INET6) {
+		auto* address6 = reinterpret_cast<sockaddr_in6*>(&storage);
+		address6->sin6_family = AF_INET6;
+		address6->sin6_port = htons(port);
+		std::memcpy(&address6->sin6_addr, address.data(), 16);
+		return sizeof(sockaddr_in6);
+	}
+	auto* address4 = reinterpret_cast<sockaddr_in*>(&storage);
+	address4->sin_family = AF_INET;
+	address4->sin_port = htons(port);
+	std::memcpy(&address4->sin_addr, address.data(), 4);
+	return sizeof(sockaddr_in);
+}
+
+std::string PeerEndpoint::to_string() const {
+	char text[INET6_ADDRSTRLEN];
+	inet_ntop(family, address.data(), text, sizeof(text));
+	if (family == AF_INET6) {
+		return "[" + std::string(text) + "]:" + std::to_string(port);
+	}
+	return std::string(text) + ":" + std::to_string(port);
+}
+
+std::optional<PeerEndpoint> PeerEndpoint::parse(const std::string& text) {
+	size_t colon_index = text.rfind(':');
+	if (colon_index == std::string::npos || colon_index + 1 == text.size()) {
+		return std::nullopt;
+	}
+	std::string host = text.substr(0, colon_index);
+	PeerEndpoint endpoint;
+	if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+		host = host.substr(1, host.size() - 2);
+		endpoint.family = AF_INET6;
+	}
+	if (inet_pton(endpoint.family, host.c_str(), endpoint.address.data()) <=
+		0) {
+		return std::nullopt;
+	}
+	unsigned long port = 0;
+	for (size_t i = colon_index + 1; i < text.size(); i++) {
+		if (text[i] < '0' || text[i] > '9' || port > 65535) {
+			return std::nullopt;
+		}
+		port = port * 10 + (text[i] - '0');
+	}
+	if (port > 65535) {
+		return std::nullopt;
+	}
+	endpoint.port = port;
+	return endpoint;
+}
+
+PeerEndpoint PeerEndpoint::from_sockaddr(const sockaddr_storage& storage) {
+	PeerEndpoint endpoint;
+	if (storage.ss_family == AF_INET6) {
+		const auto* address6 = reinterpret_cast<const sockaddr_in6*>(&storage);
+		endpoint.family = AF_INET6;
+		endpoint.port = ntohs(address6->sin6_port);
+		std::memcpy(endpoint.address.data(), &address6->sin6_addr, 16);
+	} else {
+		const auto* address4 = reinterpret_cast<const sockaddr_in*>(&storage);
+		endpoint.port = ntohs(address4->sin_port);
+		std::memcpy(endpoint.address.data(), &address4->sin_addr, 4);
+	}
+	return endpoint;
+}
+
+size_t PeerEndpointHash::operator()(
+	const PeerEndpoint& endpoint) const noexcept {
+	// FNV-1a over the bytes that make up the endpoint
+	std::uint64_t hash = 14695981039346656037ull;
+	auto mix = [&](std::uint8_t byte) {
+		hash ^= byte;
+		hash *= 1099511628211ull;
+	};
+	size_t address_size = endpoint.family == AF_INET6 ? 16 : 4;
+	for (size_t i = 0; i < address_size; i++) {
+		mix(endpoint.address[i]);
+	}
+	mix(endpoint.port >> 8);
+	mix(endpoint.port);
+	mix(endpoint.family);
+	return hash;
+}
+
+// Both decoders size the output once and fill it in a branch-free loop
+// over fixed-size records, which the compiler can unroll and vectorize.
+void decode_compact_peers(std::string_view compact,
+						  std::vector<PeerEndpoint>& peers) {
+	size_t count = compact.size() / 6;
+	size_t first = peers.size();
+	peers.resize(first + count);
+	const auto* data = reinterpret_cast<const std::uint8_t*>(compact.data());
+	PeerEndpoint* out = peers.data() + first;
+	for (size_t i = 0; i < count; i++, data += 6) {
+		std::memcpy(out[i].address.data(), data, 4);
+		out[i].port = std::uint16_t(data[4] << 8 | data[5]);
+		out[i].family = AF_INET;
+	}
+}
+
+void decode_compact_peers6(std::string_view compact,
+						   std::vector<PeerEndpoint>& peers) {
+	size_t count = compact.size() / 18;
+	size_t first = peers.size();
+	peers.resize(first + count);
+	const auto* data = reinterpret_cast<const std::uint8_t*>(compact.data());
+	PeerEndpoint* out = peers.data() + first;
+	for (size_t i = 0; i < count; i++, data += 18) {
+		std::memcpy(out[i].address.data(), data, 16);
+		out[i].port = std::uint16_t(data[16] << 8 | data[17]);
+		out[i].family = AF_INET6;
+	}
+}
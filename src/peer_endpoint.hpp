@@ -0,0 +1,45 @@
+#ifndef PEER_ENDPOINT_HPP
+#define PEER_ENDPOINT_HPP
+
+#include <sys/socket.h>
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+// Peer address kept in binary form from the tracker reply to connect();
+// IPv4 addresses use the first 4 bytes of address.
+struct PeerEndpoint {
+	std::array<std::uint8_t, 16> address{};
+	std::uint16_t port = 0;	 // host byte order
+	std::uint8_t family = AF_INET;
+
+	bool operator==(const PeerEndpoint&) const = default;
+
+	socklen_t to_sockaddr(sockaddr_storage& storage) const;
+	// "1.2.3.4:6881" or "[::1]:6881"
+	std::string to_string() const;
+	// accepts the to_string forms
+	static std::optional<PeerEndpoint> parse(const std::string& text);
+	static PeerEndpoint from_sockaddr(const sockaddr_storage& storage);
+};
+
+struct PeerEndpointHash {
+	size_t operator()(const PeerEndpoint& endpoint) const noexcept;
+};
+
+using PeerEndpointSet = std::unordered_set<PeerEndpoint, PeerEndpointHash>;
+
+// Appends the entries of a compact "peers" string (6 bytes per IPv4 peer)
+// or a BEP 7 "peers6" string (18 bytes per IPv6 peer). Trailing partial
+// entries are ignored.
+void decode_compact_peers(std::string_view compact,
+						  std::vector<PeerEndpoint>& peers);
+void decode_compact_peers6(std::string_view compact,
+						   std::vector<PeerEndpoint>& peers);
+
+#endif	// PEER_ENDPOINT_HPP
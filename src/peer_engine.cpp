@@ -0,0 +1,857 @@
+#include "peer_engine.hpp"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+
+#include "util.hpp"
+#include "wire.hpp"
+
+namespace {
+
+// stop reading one socket after this much so the others get a turn
+constexpr size_t MAX_RECEIVE_PER_EVENT = 1 << 20;
+// a PIECE carrying a 128 KiB block is the largest message we accept,
+// except for a bitfield of a very large torrent
+constexpr size_t MAX_MESSAGE_LENGTH = (1 << 17) + 9;
+
+// endgame asks at most this many peers for the same block
+constexpr std::uint8_t MAX_BLOCK_REQUESTS = 3;
+// piece buffers kept for reuse
+constexpr size_t BUFFER_POOL_SIZE = 16;
+// back-to-back blocks read in one event before other peers get a turn
+constexpr int MAX_READS_PER_EVENT = 64;
+
+}  // namespace
+
+PeerEngine::PeerEngine(TorrentLayout torrent, PeerEngineOptions options)
+	: torrent_(std::move(torrent)),
+	  options_(std::move(options)),
+	  max_message_length_(std::max<size_t>(
+		  MAX_MESSAGE_LENGTH, (torrent_.piece_count() + 7) / 8 + 1)),
+	  wanted_(torrent_.piece_count(), false),
+	  done_(torrent_.piece_count(), false),
+	  picker_(torrent_.piece_count()),
+	  max_have_list_(std::sqrt(torrent_.piece_count())) {
+	wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd_ < 0) {
+		throw std::system_error{errno, std::system_category(), "eventfd"};
+	}
+#ifdef BITTORRENT_IO_URING
+	ring_start();
+	if (ring_) {
+		return;
+	}
+#endif
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0) {
+		int error = errno;
+		close(wake_fd_);
+		throw std::system_error{error, std::system_category(), "epoll_create1"};
+	}
+	epoll_event event{};
+	event.events = EPOLLIN;
+	event.data.fd = wake_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event);
+}
+
+PeerEngine::~PeerEngine() {
+#ifdef BITTORRENT_IO_URING
+	// tearing the ring down first ends whatever is still in flight
+	ring_.reset();
+	for (auto& [fd, peer] : closing_) {
+		close(fd);
+	}
+#endif
+	for (auto& [fd, peer] : peers_) {
+		close(fd);
+	}
+	close(wake_fd_);
+	if (epoll_fd_ >= 0) {
+		close(epoll_fd_);
+	}
+}
+
+void PeerEngine::add_peers(const std::vector<PeerEndpoint>& peers) {
+	{
+		std::lock_guard<std::mutex> lock(incoming_mutex_);
+		incoming_.insert(incoming_.end(), peers.begin(), peers.end());
+	}
+	std::uint64_t one = 1;
+	write(wake_fd_, &one, sizeof(one));
+}
+
+void PeerEngine::expect_more_peers(bool expect) {
+	{
+		std::lock_guard<std::mutex> lock(incoming_mutex_);
+		expect_more_ = expect;
+	}
+	std::uint64_t one = 1;
+	write(wake_fd_, &one, sizeof(one));
+}
+
+void PeerEngine::recycle(std::vector<char> buffer) {
+	{
+		std::lock_guard<std::mutex> lock(incoming_mutex_);
+		recycled_.push_back(std::move(buffer));
+	}
+	std::uint64_t one = 1;
+	write(wake_fd_, &one, sizeof(one));
+}
+
+void PeerEngine::mark_done(std::uint32_t piece) {
+	if (piece < done_.size() && !wanted_[piece]) {
+		done_[piece] = true;
+	}
+}
+
+void PeerEngine::want_piece(std::uint32_t piece) {
+	if (piece < wanted_.size() && !wanted_[piece] && !done_[piece]) {
+		wanted_[piece] = true;
+		remaining_++;
+		picker_.add(piece);
+	}
+}
+
+void PeerEngine::want_all() {
+	for (std::uint32_t piece = 0; piece < wanted_.size(); piece++) {
+		want_piece(piece);
+	}
+}
+
+void PeerEngine::resume_piece(const PartialPiece& partial,
+							  const char* data) {
+	std::uint32_t piece = partial.piece;
+	if ((!piece_memory_ && (!data || buffers_full())) ||
+		piece >= wanted_.size() || !wanted_[piece] || done_[piece] ||
+		active_.contains(piece) ||
+		partial.blocks.size() != block_count(piece)) {
+		return;
+	}
+	auto received = std::count(partial.blocks.begin(), partial.blocks.end(),
+							   true);
+	// a piece with every block in would never be hashed, fetch it again
+	if (received == 0 || (size_t)received == partial.blocks.size()) {
+		return;
+	}
+	PieceProgress& progress = start_piece(piece);
+	for (std::uint32_t block = 0; block < partial.blocks.size(); block++) {
+		if (!partial.blocks[block]) {
+			continue;
+		}
+		progress.blocks[block] = block_received;
+		if (!piece_memory_) {
+			std::uint32_t begin = block * BLOCK_LENGTH;
+			std::memcpy(progress.base + begin, data + begin,
+						block_size(piece, block));
+		}
+	}
+	progress.received = received;
+}
+
+std::vector<PartialPiece> PeerEngine::partial_pieces() const {
+	std::vector<PartialPiece> partial;
+	for (const auto& [piece, progress] : active_) {
+		if (progress.received == 0) {
+			continue;
+		}
+		std::vector<bool> blocks(progress.blocks.size());
+		for (size_t block = 0; block < blocks.size(); block++) {
+			blocks[block] = progress.blocks[block] == block_received;
+		}
+		partial.push_back({piece, std::move(blocks)});
+	}
+	return partial;
+}
+
+const char* PeerEngine::piece_data(std::uint32_t piece) const {
+	auto it = active_.find(piece);
+	return it == active_.end() ? nullptr : it->second.base;
+}
+
+void PeerEngine::stop() {
+	stopping_ = true;
+	std::uint64_t one = 1;
+	write(wake_fd_, &one, sizeof(one));
+}
+
+size_t PeerEngine::peer_count() const {
+	return std::count_if(peers_.begin(), peers_.end(), [](const auto& entry) {
+		return entry.second.state == PeerState::active;
+	});
+}
+
+bool PeerEngine::run() {
+	Clock::time_point last_tick = Clock::now();
+	while (remaining_ > 0 && !stopping_) {
+		bool expect_more = take_new_peers();
+		take_recycled();
+		start_connections();
+		if (peers_.empty() && candidates_.empty() && !expect_more) {
+			break;
+		}
+		if (!wait_events()) {
+			break;
+		}
+		if (rebalance_) {
+			rebalance();
+		}
+		flush_dirty();
+		Clock::time_point now = Clock::now();
+		if (now - last_tick >= std::chrono::seconds(1)) {
+			last_tick = now;
+			check_timeouts(now);
+			if (on_tick) {
+				on_tick();
+			}
+		}
+	}
+	// peers still connecting were cut short by us, not found bad
+	while (!peers_.empty()) {
+		close_peer(peers_.begin()->second, false);
+	}
+#ifdef BITTORRENT_IO_URING
+	while (ring_ && !closing_.empty() && ring_wait()) {
+	}
+#endif
+	return remaining_ == 0;
+}
+
+bool PeerEngine::take_new_peers() {
+	std::lock_guard<std::mutex> lock(incoming_mutex_);
+	for (const PeerEndpoint& endpoint : incoming_) {
+		if (known_.insert(endpoint).second) {
+			candidates_.push_back(endpoint);
+		}
+	}
+	incoming_.clear();
+	return expect_more_;
+}
+
+void PeerEngine::take_recycled() {
+	std::lock_guard<std::mutex> lock(incoming_mutex_);
+	if (recycled_.empty()) {
+		return;
+	}
+	for (std::vector<char>& buffer : recycled_) {
+		buffered_bytes_ -= buffer.size();
+		if (buffer_pool_.size() < BUFFER_POOL_SIZE) {
+			buffer_pool_.push_back(std::move(buffer));
+		}
+	}
+	recycled_.clear();
+	// there may be room for new pieces again
+	rebalance_ = true;
+}
+
+void PeerEngine::start_connections() {
+	while (peers_.size() < options_.max_peers && !candidates_.empty()) {
+		PeerEndpoint endpoint = candidates_.front();
+		candidates_.pop_front();
+		connect_peer(endpoint);
+	}
+}
+
+void PeerEngine::connect_peer(const PeerEndpoint& endpoint) {
+#ifdef BITTORRENT_IO_URING
+	if (ring_) {
+		ring_connect(endpoint);
+		return;
+	}
+#endif
+	sockaddr_storage address;
+	socklen_t address_length = endpoint.to_sockaddr(address);
+	int fd = socket(endpoint.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+					0);
+	if (fd < 0) {
+		return;
+	}
+	if (connect(fd, (struct sockaddr*)&address, address_length) < 0 &&
+		errno != EINPROGRESS) {
+		close(fd);
+		if (on_handshake) {
+			on_handshake(endpoint, false);
+		}
+		return;
+	}
+	epoll_event event{};
+	event.events = EPOLLIN | EPOLLOUT;
+	event.data.fd = fd;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+		close(fd);
+		return;
+	}
+	Peer& peer = add_peer(fd, endpoint);
+	peer.want_write = true;
+}
+
+PeerEngine::Peer& PeerEngine::add_peer(int fd, const PeerEndpoint& endpoint) {
+	Peer& peer = peers_.try_emplace(fd, max_message_length_).first->second;
+	peer.fd = fd;
+	peer.endpoint = endpoint;
+	peer.connected_at = Clock::now();
+	peer.last_progress = peer.connected_at;
+	peer.have.assign(torrent_.piece_count(), false);
+	// handshake and interested go out as soon as the connect completes
+	wire::append_handshake(peer.out, torrent_.info_hash, options_.peer_id);
+	wire::append(peer.out, wire::simple_message(wire::interested));
+	return peer;
+}
+
+void PeerEngine::close_peer(Peer& peer, bool failed) {
+	if (peer.state != PeerState::active) {
+		if (failed && on_handshake) {
+			on_handshake(peer.endpoint, false);
+		}
+	} else if (on_peer_closed) {
+		std::chrono::duration<double> elapsed =
+			Clock::now() - peer.connected_at;
+		std::uint32_t bytes_per_second = 0;
+		if (elapsed.count() > 0) {
+			bytes_per_second = peer.downloaded / elapsed.count();
+		}
+		on_peer_closed(peer.endpoint, bytes_per_second);
+	}
+	picker_.peer_lost(peer.have);
+	release_requests(peer);
+#ifdef BITTORRENT_IO_URING
+	if (ring_) {
+		ring_close(peer);
+		return;
+	}
+#endif
+	int fd = peer.fd;
+	drop_incoming(peer);
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	peers_.erase(fd);
+}
+
+// The block the peer was reading in place can come from someone else now
+void PeerEngine::drop_incoming(Peer& peer) {
+	if (!peer.incoming) {
+		return;
+	}
+	auto it = active_.find(peer.incoming->piece);
+	if (it != active_.end()) {
+		it->second.writing[peer.incoming->block] = false;
+	}
+	peer.incoming.reset();
+}
+
+void PeerEngine::check_timeouts(Clock::time_point now) {
+	std::vector<int> expired;
+	for (auto& [fd, peer] : peers_) {
+		if (peer.state != PeerState::active) {
+			if (now - peer.connected_at > options_.connect_timeout) {
+				expired.push_back(fd);
+			}
+		} else if (!peer.requests.empty() &&
+				   now - peer.last_progress > options_.request_timeout) {
+			expired.push_back(fd);
+		}
+	}
+	for (int fd : expired) {
+		close_peer(peers_.at(fd));
+	}
+}
+
+bool PeerEngine::wait_events() {
+#ifdef BITTORRENT_IO_URING
+	if (ring_) {
+		return ring_wait();
+	}
+#endif
+	std::array<epoll_event, 64> events;
+	int count = epoll_wait(epoll_fd_, events.data(), events.size(), 1000);
+	if (count < 0) {
+		if (errno == EINTR) {
+			return true;
+		}
+		std::cerr << "epoll_wait failed: " << std::strerror(errno) << std::endl;
+		return false;
+	}
+	for (int i = 0; i < count; i++) {
+		int fd = events[i].data.fd;
+		if (fd == wake_fd_) {
+			std::uint64_t value;
+			read(wake_fd_, &value, sizeof(value));
+			continue;
+		}
+		auto it = peers_.find(fd);
+		if (it == peers_.end()) {
+			continue;
+		}
+		if (!on_event(it->second, events[i].events)) {
+			close_peer(it->second);
+		}
+	}
+	return true;
+}
+
+bool PeerEngine::on_event(Peer& peer, std::uint32_t events) {
+	if (peer.state == PeerState::connecting) {
+		int error = 0;
+		socklen_t length = sizeof(error);
+		getsockopt(peer.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+		if (error != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+			return false;
+		}
+		if (!(events & EPOLLOUT)) {
+			return true;
+		}
+		peer.state = PeerState::handshaking;
+	}
+	if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+		size_t budget = MAX_RECEIVE_PER_EVENT;
+		for (int i = 0; i < MAX_READS_PER_EVENT; i++) {
+			MessageReader::Status status = peer.reader.receive(peer.fd, budget);
+			if (status == MessageReader::Status::closed ||
+				status == MessageReader::Status::error || !process_input(peer)) {
+				return false;
+			}
+			if (status != MessageReader::Status::more || budget == 0) {
+				break;
+			}
+		}
+	}
+	fill_requests(peer);
+	mark_dirty(peer);
+	return true;
+}
+
+void PeerEngine::mark_dirty(Peer& peer) {
+	if (!peer.dirty) {
+		peer.dirty = true;
+		dirty_.push_back(peer.fd);
+	}
+}
+
+// Everything queued for a peer during one loop tick goes out in one send
+void PeerEngine::flush_dirty() {
+	std::vector<int> failed;
+	for (int fd : dirty_) {
+		auto it = peers_.find(fd);
+		if (it == peers_.end()) {
+			continue;
+		}
+		Peer& peer = it->second;
+		peer.dirty = false;
+		if (!flush(peer)) {
+			failed.push_back(fd);
+			continue;
+		}
+		update_interest(peer);
+	}
+	dirty_.clear();
+	for (int fd : failed) {
+		close_peer(peers_.at(fd));
+	}
+}
+
+bool PeerEngine::flush(Peer& peer) {
+	if (peer.state == PeerState::connecting) {
+		return true;
+	}
+#ifdef BITTORRENT_IO_URING
+	if (ring_) {
+		if (!peer.send_in_flight) {
+			ring_send(peer);
+		}
+		return true;
+	}
+#endif
+	size_t sent_total = 0;
+	while (sent_total < peer.out.size()) {
+		ssize_t sent = send(peer.fd, peer.out.data() + sent_total,
+							peer.out.size() - sent_total, MSG_NOSIGNAL);
+		if (sent > 0) {
+			sent_total += sent;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
+		} else if (errno != EINTR) {
+			return false;
+		}
+	}
+	peer.out.erase(peer.out.begin(), peer.out.begin() + sent_total);
+	return true;
+}
+
+void PeerEngine::update_interest(Peer& peer) {
+	if (epoll_fd_ < 0) {
+		return;
+	}
+	bool want_write =
+		!peer.out.empty() || peer.state == PeerState::connecting;
+	if (want_write == peer.want_write) {
+		return;
+	}
+	peer.want_write = want_write;
+	epoll_event event{};
+	event.events = EPOLLIN | (want_write ? std::uint32_t(EPOLLOUT) : 0u);
+	event.data.fd = peer.fd;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, peer.fd, &event);
+}
+
+void PeerEngine::rebalance() {
+	rebalance_ = false;
+	for (auto& [fd, peer] : peers_) {
+		fill_requests(peer);
+		mark_dirty(peer);
+	}
+}
+
+bool PeerEngine::process_input(Peer& peer) {
+	if (peer.state == PeerState::handshaking) {
+		const char* handshake = peer.reader.handshake();
+		if (!handshake) {
+			return true;
+		}
+		if (handshake[0] != 19 ||
+			std::memcmp(handshake + 1, "BitTorrent protocol", 19) != 0 ||
+			std::memcmp(handshake + 28, torrent_.info_hash.data(), 20) != 0) {
+			return false;
+		}
+		peer.state = PeerState::active;
+		peer.last_progress = Clock::now();
+		if (on_handshake) {
+			on_handshake(peer.endpoint, true);
+		}
+	}
+	auto sink = [this, &peer](std::uint32_t piece, std::uint32_t begin,
+							  std::uint32_t length) {
+		return block_destination(peer, piece, begin, length);
+	};
+	const char* message;
+	size_t length;
+	while (peer.reader.next(message, length, sink)) {
+		if (!handle_message(peer, message, length)) {
+			return false;
+		}
+	}
+	return !peer.reader.failed();
+}
+
+bool PeerEngine::handle_message(Peer& peer, const char* message,
+								size_t length) {
+	switch (static_cast<std::uint8_t>(message[0])) {
+		case wire::choke:
+			peer.choked = true;
+			release_requests(peer);
+			break;
+		case wire::unchoke:
+			peer.choked = false;
+			break;
+		case wire::have:
+			if (length >= 5) {
+				std::uint32_t piece = wire::read_uint32(message + 1);
+				if (piece < peer.have.size() && !peer.have[piece]) {
+					peer_has(peer, piece);
+				}
+			}
+			break;
+		case wire::bitfield:
+			for (std::uint32_t piece = 0;
+				 piece < peer.have.size() && piece / 8 + 1 < length; piece++) {
+				if (!peer.have[piece] &&
+					((message[1 + piece / 8] >> (7 - piece % 8)) & 1)) {
+					peer_has(peer, piece);
+				}
+			}
+			break;
+		case wire::piece:
+			if (length < 9) {
+				return false;
+			}
+			handle_block(peer, wire::read_uint32(message + 1),
+						 wire::read_uint32(message + 5), length - 9);
+			break;
+		default:
+			break;
+	}
+	return true;
+}
+
+// A peer with k of n pieces is picked for from its list in O(k) steps,
+// or by the picker's scan in about n / k; past k = sqrt(n) the scan is
+// cheaper and the list goes
+void PeerEngine::peer_has(Peer& peer, std::uint32_t piece) {
+	peer.have[piece] = true;
+	picker_.peer_has(piece);
+	if (!peer.have_listed) {
+		return;
+	}
+	if (peer.have_list.size() < max_have_list_) {
+		peer.have_list.push_back(piece);
+	} else {
+		peer.have_listed = false;
+		peer.have_list = {};
+	}
+}
+
+// Validates the block against the piece in progress and hands out its
+// place in the piece buffer. A block that is already in, or being read
+// from another peer, is dropped.
+char* PeerEngine::block_destination(Peer& peer, std::uint32_t piece,
+									std::uint32_t begin, std::uint32_t length) {
+	peer.incoming.reset();
+	auto it = active_.find(piece);
+	std::uint32_t block = begin / BLOCK_LENGTH;
+	if (it == active_.end() || begin % BLOCK_LENGTH != 0 ||
+		block >= block_count(piece) || length != block_size(piece, block)) {
+		return nullptr;
+	}
+	PieceProgress& progress = it->second;
+	if (progress.blocks[block] == block_received || progress.writing[block]) {
+		return nullptr;
+	}
+	progress.writing[block] = true;
+	peer.incoming = BlockRequest{piece, block};
+	return progress.base + begin;
+}
+
+void PeerEngine::handle_block(Peer& peer, std::uint32_t piece,
+							  std::uint32_t begin, size_t length) {
+	peer.last_progress = Clock::now();
+	peer.downloaded += length;
+	downloaded_ += length;
+	std::uint32_t block = begin / BLOCK_LENGTH;
+	// The request window is this list, not a count: a block released by a
+	// CHOKE, or a duplicate, that turns up late matches nothing here and
+	// cannot take room in the window for good
+	auto request = std::find_if(
+		peer.requests.begin(), peer.requests.end(),
+		[&](const BlockRequest& r) { return r.piece == piece && r.block == block; });
+	if (request != peer.requests.end()) {
+		peer.requests.erase(request);
+	}
+	// only a block block_destination accepted is in the piece buffer
+	if (!peer.incoming || peer.incoming->piece != piece ||
+		peer.incoming->block != block) {
+		return;
+	}
+	peer.incoming.reset();
+	auto it = active_.find(piece);
+	PieceProgress& progress = it->second;
+	progress.writing[block] = false;
+	if (progress.blocks[block] > 1) {
+		cancel_duplicates(peer, piece, block);
+	}
+	progress.blocks[block] = block_received;
+	progress.received++;
+	if (progress.received < progress.blocks.size()) {
+		return;
+	}
+	if (sha1_hash(progress.base, torrent_.piece_size(piece)) !=
+		byte_string_to_hex(torrent_.piece_hash(piece))) {
+		std::cerr << "Piece " << piece << " failed the hash check"
+				  << std::endl;
+		std::fill(progress.blocks.begin(), progress.blocks.end(),
+				  block_missing);
+		progress.received = 0;
+		progress.first_missing = 0;
+		rebalance_ = true;
+		return;
+	}
+	done_[piece] = true;
+	remaining_--;
+	size_t size = progress.data.size();
+	if (on_piece) {
+		on_piece(piece, progress.data);
+	}
+	// a buffer the callback kept stays counted until it is recycled
+	if (!progress.data.empty()) {
+		buffered_bytes_ -= size;
+		if (buffer_pool_.size() < BUFFER_POOL_SIZE) {
+			buffer_pool_.push_back(std::move(progress.data));
+		}
+	}
+	active_.erase(it);
+}
+
+void PeerEngine::release_requests(Peer& peer) {
+	for (const BlockRequest& request : peer.requests) {
+		auto it = active_.find(request.piece);
+		if (it == active_.end()) {
+			continue;
+		}
+		std::uint8_t& state = it->second.blocks[request.block];
+		if (state == block_missing || state == block_received) {
+			continue;
+		}
+		// in endgame other peers may still be fetching the block
+		if (--state == block_missing) {
+			it->second.first_missing =
+				std::min(it->second.first_missing, request.block);
+			rebalance_ = true;
+		}
+	}
+	peer.requests.clear();
+}
+
+void PeerEngine::fill_requests(Peer& peer) {
+	if (peer.state != PeerState::active || peer.choked) {
+		return;
+	}
+	// top the window up in batches rather than one request per block, so
+	// requests share a send
+	if (peer.requests.size() * 2 > (size_t)options_.queue_depth) {
+		return;
+	}
+	if (peer.requests.empty()) {
+		// the request timeout counts from the first request
+		peer.last_progress = Clock::now();
+	}
+	BlockRequest request;
+	while ((std::int64_t)peer.requests.size() < options_.queue_depth &&
+		   (next_block(peer, request) ||
+			(in_endgame() && next_endgame_block(peer, request)))) {
+		active_.at(request.piece).blocks[request.block]++;
+		peer.requests.push_back(request);
+		wire::append(peer.out, wire::block_message(
+								   wire::request, request.piece,
+								   request.block * BLOCK_LENGTH,
+								   block_size(request.piece, request.block)));
+	}
+}
+
+bool PeerEngine::next_block(const Peer& peer, BlockRequest& request) {
+	// finish the pieces already started before opening new ones
+	for (auto& [piece, progress] : active_) {
+		if (!peer.have[piece]) {
+			continue;
+		}
+		while (progress.first_missing < progress.blocks.size() &&
+			   progress.blocks[progress.first_missing] != block_missing) {
+			progress.first_missing++;
+		}
+		if (progress.first_missing < progress.blocks.size()) {
+			request = {piece, progress.first_missing};
+			return true;
+		}
+	}
+	if (buffers_full()) {
+		return false;
+	}
+	std::optional<std::uint32_t> piece = picker_.pick(
+		peer.have, peer.have_listed ? &peer.have_list : nullptr);
+	if (!piece) {
+		return false;
+	}
+	start_piece(*piece);
+	request = {*piece, 0};
+	return true;
+}
+
+PeerEngine::PieceProgress& PeerEngine::start_piece(std::uint32_t piece) {
+	picker_.remove(piece);
+	PieceProgress& progress = active_[piece];
+	if (piece_memory_) {
+		progress.base = piece_memory_ + piece * torrent_.piece_length;
+	} else {
+		buffered_bytes_ += torrent_.piece_size(piece);
+		if (!buffer_pool_.empty()) {
+			progress.data = std::move(buffer_pool_.back());
+			buffer_pool_.pop_back();
+		}
+		progress.data.resize(torrent_.piece_size(piece));
+		progress.base = progress.data.data();
+	}
+	progress.blocks.assign(block_count(piece), block_missing);
+	progress.writing.assign(block_count(piece), false);
+	return progress;
+}
+
+// Every block still missing is requested from somebody: no piece is left
+// to start and no started piece has a block nobody was asked for
+bool PeerEngine::in_endgame() {
+	if (picker_.pickable_count() > 0) {
+		return false;
+	}
+	for (auto& [piece, progress] : active_) {
+		while (progress.first_missing < progress.blocks.size() &&
+			   progress.blocks[progress.first_missing] != block_missing) {
+			progress.first_missing++;
+		}
+		if (progress.first_missing < progress.blocks.size()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool PeerEngine::next_endgame_block(const Peer& peer, BlockRequest& request) {
+	for (auto& [piece, progress] : active_) {
+		if (!peer.have[piece]) {
+			continue;
+		}
+		for (std::uint32_t block = 0; block < progress.blocks.size(); block++) {
+			std::uint8_t state = progress.blocks[block];
+			if (state == block_missing || state == block_received ||
+				state >= MAX_BLOCK_REQUESTS) {
+				continue;
+			}
+			bool requested = std::any_of(
+				peer.requests.begin(), peer.requests.end(),
+				[&](const BlockRequest& r) {
+					return r.piece == piece && r.block == block;
+				});
+			if (!requested) {
+				request = {piece, block};
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void PeerEngine::cancel_duplicates(const Peer& receiver, std::uint32_t piece,
+								   std::uint32_t block) {
+	for (auto& [fd, peer] : peers_) {
+		if (&peer == &receiver) {
+			continue;
+		}
+		auto it = std::find_if(
+			peer.requests.begin(), peer.requests.end(),
+			[&](const BlockRequest& r) {
+				return r.piece == piece && r.block == block;
+			});
+		if (it == peer.requests.end()) {
+			continue;
+		}
+		peer.requests.erase(it);
+		wire::append(peer.out, wire::block_message(wire::cancel, piece,
+												   block * BLOCK_LENGTH,
+												   block_size(piece, block)));
+		mark_dirty(peer);
+		// the window has room again
+		rebalance_ = true;
+	}
+}
+
+// Another piece would go over the memory cap. With nothing buffered one
+// piece is always allowed, whatever its size.
+bool PeerEngine::buffers_full() const {
+	return buffered_bytes_ > 0 &&
+		   buffered_bytes_ + torrent_.piece_length >
+			   (std::int64_t)options_.max_buffered_bytes;
+}
+
+std::uint32_t PeerEngine::block_count(std::uint32_t piece) const {
+	return (torrent_.piece_size(piece) + BLOCK_LENGTH - 1) / BLOCK_LENGTH;
+}
+
+std::uint32_t PeerEngine::block_size(std::uint32_t piece,
+									 std::uint32_t block) const {
+	return std::min<std::int64_t>(
+		BLOCK_LENGTH, torrent_.piece_size(piece) - block * BLOCK_LENGTH);
+}
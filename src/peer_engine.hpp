@@ -0,0 +1,278 @@
+#ifndef PEER_ENGINE_HPP
+#define PEER_ENGINE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "message_reader.hpp"
+#include "peer_endpoint.hpp"
+#include "piece_picker.hpp"
+#include "torrent.hpp"
+
+#ifdef BITTORRENT_IO_URING
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <memory>
+
+#include "io_uring.hpp"
+#endif
+
+struct PeerEngineOptions {
+	size_t max_peers = 100;		   // connections open at once
+	std::int64_t queue_depth = 32;  // outstanding requests per peer
+	std::chrono::milliseconds connect_timeout{5000};
+	// a peer that sends nothing while we wait on its requests is dropped
+	std::chrono::milliseconds request_timeout{30000};
+	// memory for piece buffers: pieces being downloaded plus those handed
+	// out and not recycled yet; no new piece is started past this
+	size_t max_buffered_bytes = 64 << 20;
+	std::string peer_id = "12345678901234567890";
+};
+
+// pieces are requested, and put together, in blocks of this size
+constexpr std::uint32_t BLOCK_LENGTH = 16384;
+
+// A piece some of whose blocks are in already
+struct PartialPiece {
+	std::uint32_t piece;
+	std::vector<bool> blocks;  // received
+};
+
+// Downloads pieces from many peers at once on a single thread. Every
+// connection is non-blocking and driven by epoll through its own state
+// machine (connect, handshake, bitfield/interested, unchoke, requests);
+// blocks of the pieces in progress are handed to whichever unchoked peer
+// has room in its request window, so one piece can come from several
+// peers. Once every missing block is requested the engine goes into
+// endgame: blocks still in flight are requested again from other peers
+// that have them, and the losers get a CANCEL when the first copy lands.
+//
+// Built with BITTORRENT_IO_URING the sockets go through io_uring instead
+// when the kernel allows it: connects, reads and sends are submitted to
+// the ring and the engine reacts to their completions, one syscall per
+// loop tick for all peers. Sockets sit in a table of fixed files so the
+// kernel does not look them up on every operation.
+class PeerEngine {
+   public:
+	using Clock = std::chrono::steady_clock;
+	// A verified piece. The callback may move the buffer out; it counts
+	// against max_buffered_bytes until it comes back through recycle().
+	using PieceCallback =
+		std::function<void(std::uint32_t piece, std::vector<char>& data)>;
+	using HandshakeCallback =
+		std::function<void(const PeerEndpoint& peer, bool ok)>;
+	using PeerClosedCallback = std::function<void(
+		const PeerEndpoint& peer, std::uint32_t bytes_per_second)>;
+
+	explicit PeerEngine(TorrentLayout torrent, PeerEngineOptions options = {});
+	~PeerEngine();
+	PeerEngine(const PeerEngine&) = delete;
+	PeerEngine& operator=(const PeerEngine&) = delete;
+
+	// Both are safe to call from any thread and wake the loop. While more
+	// peers are expected run() keeps waiting even with no peer left.
+	void add_peers(const std::vector<PeerEndpoint>& peers);
+	void expect_more_peers(bool expect);
+	// a piece buffer the piece callback took, once its data is written
+	void recycle(std::vector<char> buffer);
+
+	// A piece that is on disk already, from an earlier run; it is never
+	// wanted. Called before want_piece() or want_all().
+	void mark_done(std::uint32_t piece);
+	void want_piece(std::uint32_t piece);
+	void want_all();
+
+	// Puts pieces together straight in this memory, piece i at
+	// i * piece_length (the output file, mapped), instead of in buffers of
+	// their own. The buffer on_piece gets is empty then.
+	void set_piece_memory(char* memory) { piece_memory_ = memory; }
+	// Continues a wanted piece from the blocks received in an earlier run:
+	// with piece memory they are in it already, otherwise they are copied
+	// from data, the whole piece as it was saved
+	void resume_piece(const PartialPiece& partial,
+					  const char* data = nullptr);
+	// Pieces in progress that have some blocks in, and where a piece in
+	// progress is put together (nullptr for any other piece)
+	std::vector<PartialPiece> partial_pieces() const;
+	const char* piece_data(std::uint32_t piece) const;
+
+	// Runs until every wanted piece is verified (true) or there is nobody
+	// left to download from (false); all connections are closed on return
+	bool run();
+	// Makes run() return soon; safe to call from a signal handler
+	void stop();
+	bool stopped() const { return stopping_; }
+
+	std::int64_t downloaded() const { return downloaded_; }
+	// peers past the handshake
+	size_t peer_count() const;
+
+	PieceCallback on_piece;
+	HandshakeCallback on_handshake;
+	PeerClosedCallback on_peer_closed;
+	// called from run() about once a second
+	std::function<void()> on_tick;
+
+   private:
+	enum class PeerState { connecting, handshaking, active };
+
+	struct BlockRequest {
+		std::uint32_t piece;
+		std::uint32_t block;
+	};
+
+	struct Peer {
+		explicit Peer(size_t max_message_length) : reader(max_message_length) {}
+
+		int fd = -1;
+		PeerEndpoint endpoint;
+		PeerState state = PeerState::connecting;
+		Clock::time_point connected_at{};
+		Clock::time_point last_progress{};
+		MessageReader reader;
+		std::vector<char> out;	// bytes queued but not sent yet
+		bool want_write = false;
+		bool dirty = false;	 // listed in dirty_
+		std::vector<bool> have;
+		// every piece it has while that is few, for picking
+		std::vector<std::uint32_t> have_list;
+		bool have_listed = true;
+		bool choked = true;
+		std::vector<BlockRequest> requests;
+		// block whose payload the reader is writing into its piece buffer
+		std::optional<BlockRequest> incoming;
+		std::int64_t downloaded = 0;
+#ifdef BITTORRENT_IO_URING
+		// io_uring: operations in flight point into these, a closed peer
+		// is kept until all of them completed
+		sockaddr_storage address{};
+		iovec read_vectors[2];
+		std::vector<char> sending;	// out moves here for the send in flight
+		size_t sent = 0;
+		bool send_in_flight = false;
+		int in_flight = 0;
+		int slot = -1;	// in the fixed file table, -1 if it had no room
+#endif
+	};
+
+	// a block is missing, requested from that many peers, or received
+	static constexpr std::uint8_t block_missing = 0;
+	static constexpr std::uint8_t block_received = 0xff;
+
+	struct PieceProgress {
+		std::vector<char> data;
+		char* base = nullptr;  // data, or the piece's place in piece_memory_
+		std::vector<std::uint8_t> blocks;
+		// a peer is reading the block in place, duplicates are dropped
+		std::vector<bool> writing;
+		std::uint32_t received = 0;
+		std::uint32_t first_missing = 0;  // no missing block before this
+	};
+
+	bool take_new_peers();
+	void take_recycled();
+	bool buffers_full() const;
+	void start_connections();
+	void connect_peer(const PeerEndpoint& endpoint);
+	Peer& add_peer(int fd, const PeerEndpoint& endpoint);
+	// failed is false when the engine itself shuts the connection down,
+	// a handshake in progress is then not reported as failed
+	void close_peer(Peer& peer, bool failed = true);
+	void drop_incoming(Peer& peer);
+	void check_timeouts(Clock::time_point now);
+
+	bool wait_events();
+	bool on_event(Peer& peer, std::uint32_t events);
+	void mark_dirty(Peer& peer);
+	void flush_dirty();
+	bool flush(Peer& peer);
+	void update_interest(Peer& peer);
+	void rebalance();
+	bool process_input(Peer& peer);
+	bool handle_message(Peer& peer, const char* message, size_t length);
+	void peer_has(Peer& peer, std::uint32_t piece);
+	char* block_destination(Peer& peer, std::uint32_t piece,
+							std::uint32_t begin, std::uint32_t length);
+	void handle_block(Peer& peer, std::uint32_t piece, std::uint32_t begin,
+					  size_t length);
+	void release_requests(Peer& peer);
+	void fill_requests(Peer& peer);
+	bool next_block(const Peer& peer, BlockRequest& request);
+	PieceProgress& start_piece(std::uint32_t piece);
+	bool in_endgame();
+	bool next_endgame_block(const Peer& peer, BlockRequest& request);
+	void cancel_duplicates(const Peer& receiver, std::uint32_t piece,
+						   std::uint32_t block);
+
+	std::uint32_t block_count(std::uint32_t piece) const;
+	std::uint32_t block_size(std::uint32_t piece, std::uint32_t block) const;
+
+#ifdef BITTORRENT_IO_URING
+	void ring_start();
+	bool ring_wait();
+	void ring_complete(const io_uring_cqe& cqe);
+	bool ring_handle(Peer& peer, std::uint8_t operation, int result);
+	void ring_connect(const PeerEndpoint& endpoint);
+	void ring_read(Peer& peer);
+	void ring_send(Peer& peer);
+	void ring_close(Peer& peer);
+	void ring_release(Peer& peer);
+	void ring_poll_wake();
+	io_uring_sqe* peer_sqe(Peer& peer, std::uint8_t opcode,
+						   std::uint8_t operation);
+#endif
+
+	TorrentLayout torrent_;
+	PeerEngineOptions options_;
+	size_t max_message_length_;
+	int epoll_fd_ = -1;
+	int wake_fd_ = -1;
+
+	std::mutex incoming_mutex_;
+	std::vector<PeerEndpoint> incoming_;
+	bool expect_more_ = false;
+	std::vector<std::vector<char>> recycled_;
+	std::atomic<bool> stopping_ = false;
+
+	PeerEndpointSet known_;
+	std::deque<PeerEndpoint> candidates_;
+	std::unordered_map<int, Peer> peers_;
+	// peers with output queued during this loop tick
+	std::vector<int> dirty_;
+
+	std::vector<bool> wanted_;
+	std::vector<bool> done_;
+	// wanted pieces nobody has started yet, rarest first
+	PiecePicker picker_;
+	// a peer with up to this many pieces keeps a list of them
+	size_t max_have_list_;
+	std::uint32_t remaining_ = 0;
+	std::unordered_map<std::uint32_t, PieceProgress> active_;
+	// buffers of finished pieces, reused for the next ones
+	std::vector<std::vector<char>> buffer_pool_;
+	char* piece_memory_ = nullptr;
+	// bytes in active_ plus pieces handed out and not recycled yet
+	std::int64_t buffered_bytes_ = 0;
+	std::int64_t downloaded_ = 0;
+	// blocks went back to missing, idle peers may be able to take them
+	bool rebalance_ = false;
+
+#ifdef BITTORRENT_IO_URING
+	// null when the kernel has no io_uring, epoll is used then
+	std::unique_ptr<IoUring> ring_;
+	std::vector<int> free_slots_;
+	// closed peers waiting for their operations to complete
+	std::unordered_map<int, Peer> closing_;
+#endif
+};
+
+#endif	// PEER_ENGINE_HPP
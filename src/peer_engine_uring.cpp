@@ -0,0 +1,243 @@
+#ifdef BITTORRENT_IO_URING
+
+#include "peer_engine.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+
+// The io_uring side of PeerEngine. Every peer has at most one connect,
+// one read and one send in flight; the completions drive the same state
+// machine the epoll events do.
+
+namespace {
+
+// what a completion belongs to, kept in user_data below the socket's fd
+enum Operation : std::uint8_t {
+	op_connect,
+	op_read,
+	op_send,
+	op_cancel,
+	op_wake,
+};
+
+constexpr int OPERATION_BITS = 8;
+// the ring never has to hold more than this many entries at once
+constexpr size_t MAX_RING_ENTRIES = 4096;
+
+std::uint64_t user_data(int fd, Operation operation) {
+	return (std::uint64_t)fd << OPERATION_BITS | operation;
+}
+
+}  // namespace
+
+void PeerEngine::ring_start() {
+	// a connect, read, send and cancel per peer, plus the wake poll
+	size_t entries = std::min(options_.max_peers * 4 + 1, MAX_RING_ENTRIES);
+	try {
+		ring_ = std::make_unique<IoUring>(entries);
+	} catch (const std::system_error& e) {
+		std::cerr << "io_uring unavailable, using epoll: " << e.what()
+				  << std::endl;
+		return;
+	}
+	if (ring_->register_files(options_.max_peers)) {
+		for (int slot = options_.max_peers - 1; slot >= 0; slot--) {
+			free_slots_.push_back(slot);
+		}
+	}
+	ring_poll_wake();
+}
+
+bool PeerEngine::ring_wait() {
+	if (!ring_->submit_and_wait(std::chrono::milliseconds(1000))) {
+		std::cerr << "io_uring_enter failed: " << std::strerror(errno)
+				  << std::endl;
+		return false;
+	}
+	ring_->for_each_completion(
+		[this](const io_uring_cqe& cqe) { ring_complete(cqe); });
+	return true;
+}
+
+void PeerEngine::ring_complete(const io_uring_cqe& cqe) {
+	int fd = cqe.user_data >> OPERATION_BITS;
+	auto operation = static_cast<std::uint8_t>(cqe.user_data);
+	if (operation == op_wake) {
+		std::uint64_t value;
+		read(wake_fd_, &value, sizeof(value));
+		if (!(cqe.flags & IORING_CQE_F_MORE)) {
+			ring_poll_wake();
+		}
+		return;
+	}
+	if (operation == op_cancel) {
+		return;
+	}
+	auto closing = closing_.find(fd);
+	if (closing != closing_.end()) {
+		if (--closing->second.in_flight == 0) {
+			ring_release(closing->second);
+		}
+		return;
+	}
+	auto it = peers_.find(fd);
+	if (it == peers_.end()) {
+		return;
+	}
+	Peer& peer = it->second;
+	peer.in_flight--;
+	if (!ring_handle(peer, operation, cqe.res)) {
+		close_peer(peer);
+	}
+}
+
+bool PeerEngine::ring_handle(Peer& peer, std::uint8_t operation, int result) {
+	bool retry = result == -EINTR || result == -EAGAIN;
+	switch (operation) {
+		case op_connect:
+			if (result < 0) {
+				return false;
+			}
+			peer.state = PeerState::handshaking;
+			ring_read(peer);
+			// the handshake is queued already
+			mark_dirty(peer);
+			return true;
+		case op_read:
+			if (retry) {
+				ring_read(peer);
+				return true;
+			}
+			if (result <= 0) {
+				return false;
+			}
+			peer.reader.commit_read(result);
+			if (!process_input(peer)) {
+				return false;
+			}
+			fill_requests(peer);
+			mark_dirty(peer);
+			ring_read(peer);
+			return true;
+		case op_send:
+			peer.send_in_flight = false;
+			if (result < 0 && !retry) {
+				return false;
+			}
+			peer.sent += std::max(result, 0);
+			ring_send(peer);
+			return true;
+		default:
+			return true;
+	}
+}
+
+void PeerEngine::ring_connect(const PeerEndpoint& endpoint) {
+	// blocking, so the ring waits for data instead of completing reads
+	// with -EAGAIN
+	int fd = socket(endpoint.family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return;
+	}
+	Peer& peer = add_peer(fd, endpoint);
+	socklen_t address_length = endpoint.to_sockaddr(peer.address);
+	if (!free_slots_.empty() && ring_->update_file(free_slots_.back(), fd)) {
+		peer.slot = free_slots_.back();
+		free_slots_.pop_back();
+	}
+	io_uring_sqe* sqe = peer_sqe(peer, IORING_OP_CONNECT, op_connect);
+	sqe->addr = reinterpret_cast<std::uintptr_t>(&peer.address);
+	sqe->off = address_length;
+}
+
+void PeerEngine::ring_read(Peer& peer) {
+	int count = peer.reader.read_vectors(peer.read_vectors);
+	io_uring_sqe* sqe = peer_sqe(peer, IORING_OP_READV, op_read);
+	sqe->addr = reinterpret_cast<std::uintptr_t>(peer.read_vectors);
+	sqe->len = count;
+}
+
+// One send in flight per peer; whatever is queued meanwhile goes out
+// with the next one
+void PeerEngine::ring_send(Peer& peer) {
+	if (peer.sent == peer.sending.size()) {
+		peer.sending.clear();
+		peer.sent = 0;
+		if (peer.out.empty()) {
+			return;
+		}
+		peer.sending.swap(peer.out);
+	}
+	io_uring_sqe* sqe = peer_sqe(peer, IORING_OP_SEND, op_send);
+	sqe->addr =
+		reinterpret_cast<std::uintptr_t>(peer.sending.data() + peer.sent);
+	sqe->len = peer.sending.size() - peer.sent;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	peer.send_in_flight = true;
+}
+
+// The kernel may still be writing into the peer's buffers, so the peer
+// only leaves peers_ here and is freed once its operations are cancelled
+void PeerEngine::ring_close(Peer& peer) {
+	int fd = peer.fd;
+	Peer& closing = closing_.insert(peers_.extract(fd)).position->second;
+	if (closing.in_flight == 0) {
+		ring_release(closing);
+		return;
+	}
+	io_uring_sqe* sqe = ring_->get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	if (closing.slot >= 0) {
+		sqe->fd = closing.slot;
+		sqe->cancel_flags |= IORING_ASYNC_CANCEL_FD_FIXED;
+	} else {
+		sqe->fd = fd;
+	}
+	sqe->user_data = user_data(fd, op_cancel);
+}
+
+void PeerEngine::ring_release(Peer& peer) {
+	int fd = peer.fd;
+	drop_incoming(peer);
+	if (peer.slot >= 0) {
+		ring_->update_file(peer.slot, -1);
+		free_slots_.push_back(peer.slot);
+	}
+	close(fd);
+	closing_.erase(fd);
+}
+
+void PeerEngine::ring_poll_wake() {
+	io_uring_sqe* sqe = ring_->get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = wake_fd_;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = user_data(wake_fd_, op_wake);
+}
+
+io_uring_sqe* PeerEngine::peer_sqe(Peer& peer, std::uint8_t opcode,
+								   std::uint8_t operation) {
+	io_uring_sqe* sqe = ring_->get_sqe();
+	sqe->opcode = opcode;
+	if (peer.slot >= 0) {
+		sqe->fd = peer.slot;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd = peer.fd;
+	}
+	sqe->user_data = user_data(peer.fd, static_cast<Operation>(operation));
+	peer.in_flight++;
+	return sqe;
+}
+
+#endif	// BITTORRENT_IO_URING
@@ -0,0 +1,128 @@
+#include "piece_picker.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+
+PiecePicker::PiecePicker(std::uint32_t piece_count)
+	: order_(piece_count),
+	  position_(piece_count),
+	  availability_(piece_count, 0),
+	  pickable_(piece_count, false),
+	  level_begin_{0} {
+	std::iota(order_.begin(), order_.end(), 0);
+	std::shuffle(order_.begin(), order_.end(),
+				 std::mt19937{std::random_device{}()});
+	for (std::uint32_t i = 0; i < piece_count; i++) {
+		position_[order_[i]] = i;
+	}
+}
+
+void PiecePicker::add(std::uint32_t piece) {
+	if (pickable_[piece]) {
+		return;
+	}
+	// level 0 up to availability + 1, one level at a time
+	for (std::uint32_t from = 0; from <= availability_[piece]; from++) {
+		move_up(piece, from);
+	}
+	pickable_[piece] = true;
+}
+
+void PiecePicker::remove(std::uint32_t piece) {
+	if (!pickable_[piece]) {
+		return;
+	}
+	for (std::uint32_t from = availability_[piece] + 1; from > 0; from--) {
+		move_down(piece, from);
+	}
+	pickable_[piece] = false;
+}
+
+void PiecePicker::peer_has(std::uint32_t piece) {
+	if (pickable_[piece]) {
+		move_up(piece, level(piece));
+	}
+	availability_[piece]++;
+}
+
+void PiecePicker::peer_lost(std::uint32_t piece) {
+	if (availability_[piece] == 0) {
+		return;
+	}
+	if (pickable_[piece]) {
+		move_down(piece, level(piece));
+	}
+	availability_[piece]--;
+}
+
+void PiecePicker::peer_has(const std::vector<bool>& have) {
+	for (std::uint32_t piece = 0; piece < have.size(); piece++) {
+		if (have[piece]) {
+			peer_has(piece);
+		}
+	}
+}
+
+void PiecePicker::peer_lost(const std::vector<bool>& have) {
+	for (std::uint32_t piece = 0; piece < have.size(); piece++) {
+		if (have[piece]) {
+			peer_lost(piece);
+		}
+	}
+}
+
+std::optional<std::uint32_t> PiecePicker::pick(
+	const std::vector<bool>& have,
+	const std::vector<std::uint32_t>* pieces) const {
+	if (pieces) {
+		// the same piece the scan would find: the earliest in order_
+		std::optional<std::uint32_t> best;
+		for (std::uint32_t piece : *pieces) {
+			if (pickable_[piece] &&
+				(!best || position_[piece] < position_[*best])) {
+				best = piece;
+			}
+		}
+		return best;
+	}
+	// level 1 holds pickable pieces nobody has
+	for (std::uint32_t i = level_begin(2); i < order_.size(); i++) {
+		if (have[order_[i]]) {
+			return order_[i];
+		}
+	}
+	return std::nullopt;
+}
+
+std::uint32_t PiecePicker::level(std::uint32_t piece) const {
+	return pickable_[piece] ? availability_[piece] + 1 : 0;
+}
+
+std::uint32_t PiecePicker::level_begin(std::uint32_t level) const {
+	return level < level_begin_.size() ? level_begin_[level] : order_.size();
+}
+
+// The piece trades places with the last piece of its level, which then
+// becomes the first piece of the next level up
+void PiecePicker::move_up(std::uint32_t piece, std::uint32_t from) {
+	std::uint32_t next = from + 1;
+	while (level_begin_.size() <= next) {
+		level_begin_.push_back(order_.size());
+	}
+	level_begin_[next]--;
+	swap_places(position_[piece], level_begin_[next]);
+}
+
+// The mirror image: swap with the first piece of the level and move the
+// level's start past it
+void PiecePicker::move_down(std::uint32_t piece, std::uint32_t from) {
+	swap_places(position_[piece], level_begin_[from]);
+	level_begin_[from]++;
+}
+
+void PiecePicker::swap_places(std::uint32_t index, std::uint32_t other_index) {
+	std::swap(order_[index], order_[other_index]);
+	position_[order_[index]] = index;
+	position_[order_[other_index]] = other_index;
+}
@@ -0,0 +1,63 @@
+#ifndef PIECE_PICKER_HPP
+#define PIECE_PICKER_HPP
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Rarest-first piece selection. All pieces sit in one array ordered by
+// level, where a piece's level is 0 while it cannot be picked (not
+// wanted, already started or done) and availability + 1 otherwise, and
+// the start of every level is kept alongside. Moving a piece one level up
+// or down is a single swap with the edge of its level, so bitfield and
+// HAVE updates are O(1) and picking scans from the rarest pieces onwards,
+// stopping at the first one the peer has. Pieces of equal rarity are kept
+// in random order so peers do not all go for the same piece.
+class PiecePicker {
+   public:
+	explicit PiecePicker(std::uint32_t piece_count);
+
+	// make a piece pickable (wanted and not started) or take it out again
+	void add(std::uint32_t piece);
+	void remove(std::uint32_t piece);
+
+	void peer_has(std::uint32_t piece);
+	void peer_lost(std::uint32_t piece);
+	void peer_has(const std::vector<bool>& have);
+	void peer_lost(const std::vector<bool>& have);
+
+	// Rarest pickable piece among those the peer has. pieces, every piece
+	// it has, can be passed for a peer with few: only those are looked at
+	// then, O(pieces). Otherwise order_ is scanned from the rarest level
+	// to the first piece the peer has; pieces are shuffled within a level,
+	// so that takes about 1/f steps for a peer with a fraction f of the
+	// level, plus whatever rarer levels it has nothing of.
+	std::optional<std::uint32_t> pick(
+		const std::vector<bool>& have,
+		const std::vector<std::uint32_t>* pieces = nullptr) const;
+
+	// pieces wanted and not started yet
+	std::uint32_t pickable_count() const {
+		return order_.size() - level_begin(1);
+	}
+
+	std::uint32_t availability(std::uint32_t piece) const {
+		return availability_[piece];
+	}
+
+   private:
+	std::uint32_t level(std::uint32_t piece) const;
+	std::uint32_t level_begin(std::uint32_t level) const;
+	void move_up(std::uint32_t piece, std::uint32_t from);
+	void move_down(std::uint32_t piece, std::uint32_t from);
+	void swap_places(std::uint32_t index, std::uint32_t other_index);
+
+	std::vector<std::uint32_t> order_;	   // pieces sorted by level
+	std::vector<std::uint32_t> position_;  // index of each piece in order_
+	std::vector<std::uint32_t> availability_;
+	std::vector<bool> pickable_;
+	// first index in order_ of every level, levels past the end are empty
+	std::vector<std::uint32_t> level_begin_;
+};
+
+#endif	// PIECE_PICKER_HPP
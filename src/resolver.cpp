@@ -0,0 +1,284 @@
+#include "resolver.hpp"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+namespace {
+
+constexpr std::chrono::seconds NEGATIVE_TTL{30};
+// RFC 8305, 5. recommended Connection Attempt Delay
+constexpr std::chrono::milliseconds CONNECTION_ATTEMPT_DELAY{250};
+
+ResolvedAddresses lookup(const std::string& host, const std::string& port,
+						 int socktype) {
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = socktype;
+	hints.ai_flags = AI_ADDRCONFIG;
+	addrinfo* info;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0) {
+		return {};
+	}
+	ResolvedAddresses addresses;
+	for (addrinfo* i = info; i; i = i->ai_next) {
+		ResolvedAddress address = {};
+		std::memcpy(&address.address, i->ai_addr, i->ai_addrlen);
+		address.length = i->ai_addrlen;
+		addresses.push_back(address);
+	}
+	freeaddrinfo(info);
+	return addresses;
+}
+
+// RFC 8305, 4. alternate families, starting with the preferred one
+ResolvedAddresses interleave_families(const ResolvedAddresses& addresses) {
+	if (addresses.empty()) {
+		return {};
+	}
+	sa_family_t first_family = addresses.front().address.ss_family;
+	ResolvedAddresses preferred, other, result;
+	for (const ResolvedAddress& address : addresses) {
+		(address.address.ss_family == first_family ? preferred : other)
+			.push_back(address);
+	}
+	for (size_t i = 0; i < std::max(preferred.size(), other.size()); i++) {
+		if (i < preferred.size()) {
+			result.push_back(preferred[i]);
+		}
+		if (i < other.size()) {
+			result.push_back(other[i]);
+		}
+	}
+	return result;
+}
+
+}  // namespace
+
+Resolver::Resolver(size_t threads, std::chrono::seconds ttl) : ttl_(ttl) {
+	for (size_t i = 0; i < threads; i++) {
+		workers_.emplace_back(&Resolver::worker, this);
+	}
+}
+
+Resolver::~Resolver() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	cv_.notify_all();
+	for (std::thread& worker : workers_) {
+		worker.join();
+	}
+}
+
+Resolver& Resolver::instance() {
+	static Resolver* resolver = new Resolver();
+	return *resolver;
+}
+
+std::shared_future<ResolvedAddresses> Resolver::resolve_async(
+	const std::string& host, const std::string& port, int socktype) {
+	std::string key = host + '\n' + port + '\n' + std::to_string(socktype);
+	auto now = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = cache_.find(key);
+	if (it == cache_.end() || now >= it->second.expiry) {
+		Entry& entry = cache_[key];
+		entry.result = start_lookup(key, host, port, socktype);
+		// until the lookup finishes, callers share the pending future
+		entry.expiry = std::chrono::steady_clock::time_point::max();
+		entry.refreshing = false;
+		return entry.result;
+	}
+	Entry& entry = it->second;
+	// refresh during the last tenth of the TTL, still answering from cache
+	if (!entry.refreshing && now >= entry.expiry - ttl_ / 10) {
+		entry.refreshing = true;
+		start_lookup(key, host, port, socktype);
+	}
+	return entry.result;
+}
+
+ResolvedAddresses Resolver::resolve(const std::string& host,
+									const std::string& port, int socktype,
+									std::int64_t timeout_ms) {
+	std::shared_future<ResolvedAddresses> result =
+		resolve_async(host, port, socktype);
+	if (timeout_ms >= 0 &&
+		result.wait_for(std::chrono::milliseconds(timeout_ms)) !=
+			std::future_status::ready) {
+		return {};
+	}
+	return result.get();
+}
+
+// called with mutex_ held
+std::shared_future<ResolvedAddresses> Resolver::start_lookup(
+	const std::string& key, const std::string& host, const std::string& port,
+	int socktype) {
+	auto promise = std::make_shared<std::promise<ResolvedAddresses>>();
+	std::shared_future<ResolvedAddresses> result = promise->get_future().share();
+	jobs_.push([this, promise, key, host, port, socktype] {
+		ResolvedAddresses addresses = lookup(host, port, socktype);
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			Entry& entry = cache_[key];
+			entry.expiry = std::chrono::steady_clock::now() +
+						   (addresses.empty() ? NEGATIVE_TTL : ttl_);
+			if (entry.refreshing) {
+				// keep serving the old answer if the refresh failed
+				if (!addresses.empty()) {
+					std::promise<ResolvedAddresses> fresh;
+					fresh.set_value(addresses);
+					entry.result = fresh.get_future().share();
+				}
+				entry.refreshing = false;
+			}
+		}
+		promise->set_value(std::move(addresses));
+	});
+	cv_.notify_one();
+	return result;
+}
+
+void Resolver::worker() {
+	for (;;) {
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+			if (stopping_) {
+				return;
+			}
+			job = std::move(jobs_.front());
+			jobs_.pop();
+		}
+		job();
+	}
+}
+
+int connect_happy_eyeballs(const ResolvedAddresses& addresses,
+						   std::int64_t timeout_ms) {
+	ResolvedAddresses candidates = interleave_families(addresses);
+	if (candidates.empty()) {
+		throw std::system_error{EHOSTUNREACH, std::system_category(),
+								"No address to connect to"};
+	}
+	auto now = std::chrono::steady_clock::now();
+	auto deadline = timeout_ms >= 0
+						? now + std::chrono::milliseconds(timeout_ms)
+						: std::chrono::steady_clock::time_point::max();
+
+	std::vector<pollfd> attempts;
+	auto close_attempts = [&](int keep) {
+		for (const pollfd& attempt : attempts) {
+			if (attempt.fd != keep) {
+				close(attempt.fd);
+			}
+		}
+	};
+	size_t next = 0;
+	int last_error = ECONNREFUSED;
+	auto next_attempt_time = now;
+	for (;;) {
+		now = std::chrono::steady_clock::now();
+		// start the next attempt when its turn has come or nothing is left
+		while (next < candidates.size() &&
+			   (now >= next_attempt_time || attempts.empty())) {
+			const ResolvedAddress& candidate = candidates[next++];
+			int fd = socket(candidate.address.ss_family,
+							SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (fd < 0) {
+				last_error = errno;
+				continue;
+			}
+			int result = connect(
+				fd, reinterpret_cast<const sockaddr*>(&candidate.address),
+				candidate.length);
+			if (result == 0) {
+				close_attempts(-1);
+				return fd;
+			}
+			if (errno != EINPROGRESS) {
+				last_error = errno;
+				close(fd);
+				continue;
+			}
+			attempts.push_back({fd, POLLOUT, 0});
+			next_attempt_time = now + CONNECTION_ATTEMPT_DELAY;
+			break;
+		}
+		if (attempts.empty()) {
+			throw std::system_error{last_error, std::system_category(),
+									"Failed to connect"};
+		}
+		if (now >= deadline) {
+			close_attempts(-1);
+			throw std::system_error{ETIMEDOUT, std::system_category(),
+									"Failed to connect"};
+		}
+
+		auto wake = std::min(deadline, next < candidates.size()
+										   ? next_attempt_time
+										   : deadline);
+		auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+			wake - now);
+		int ready = poll(attempts.data(), attempts.size(),
+						 wake == std::chrono::steady_clock::time_point::max()
+							 ? -1
+							 : std::max<std::int64_t>(wait.count(), 0));
+		if (ready < 0 && errno != EINTR) {
+			close_attempts(-1);
+			throw std::system_error{errno, std::system_category(),
+									"Failed to poll sockets"};
+		}
+		for (size_t i = 0; ready > 0 && i < attempts.size();) {
+			if (attempts[i].revents == 0) {
+				i++;
+				continue;
+			}
+			int error = 0;
+			socklen_t length = sizeof(error);
+			getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &length);
+			if (error == 0) {
+				int fd = attempts[i].fd;
+				close_attempts(fd);
+				return fd;
+			}
+			// failed early: the next address need not wait its turn
+			last_error = error;
+			close(attempts[i].fd);
+			attempts.erase(attempts.begin() + i);
+			next_attempt_time = std::chrono::steady_clock::now();
+		}
+	}
+}
+
+int connect_tcp(const std::string& host, const std::string& port,
+				std::int64_t timeout_ms) {
+	auto start = std::chrono::steady_clock::now();
+	ResolvedAddresses addresses =
+		Resolver::instance().resolve(host, port, SOCK_STREAM, timeout_ms);
+	std::int64_t elapsed_ms =
+		std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - start)
+			.count();
+	if (addresses.empty()) {
+		bool timed_out = timeout_ms >= 0 && elapsed_ms >= timeout_ms;
+		throw std::system_error{timed_out ? ETIMEDOUT : EHOSTUNREACH,
+								std::system_category(),
+								"Failed to resolve " + host};
+	}
+	// the lookup used up part of the timeout
+	if (timeout_ms >= 0) {
+		timeout_ms = std::max<std::int64_t>(timeout_ms - elapsed_ms, 0);
+	}
+	return connect_happy_eyeballs(addresses, timeout_ms);
+}
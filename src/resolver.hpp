@@ -0,0 +1,85 @@
+#ifndef RESOLVER_HPP
+#define RESOLVER_HPP
+
+#include <sys/socket.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct ResolvedAddress {
+	sockaddr_storage address;
+	socklen_t length;
+};
+
+using ResolvedAddresses = std::vector<ResolvedAddress>;
+
+// Caching getaddrinfo front end for tracker hosts. Lookups run on a small
+// worker pool; concurrent lookups of one host share the same future, and
+// an entry that is close to expiry is served while a refresh runs in the
+// background, so only the very first announce to a host waits for DNS.
+// getaddrinfo does not expose record TTLs, hence the fixed TTL.
+class Resolver {
+   public:
+	explicit Resolver(size_t threads = 4,
+					  std::chrono::seconds ttl = std::chrono::seconds{300});
+	~Resolver();
+
+	Resolver(const Resolver&) = delete;
+	Resolver& operator=(const Resolver&) = delete;
+
+	// process-wide instance, never destroyed so exit does not wait on DNS
+	static Resolver& instance();
+
+	// Ready immediately on a cache hit. An empty result means the lookup
+	// failed; failures are cached briefly too.
+	std::shared_future<ResolvedAddresses> resolve_async(const std::string& host,
+														const std::string& port,
+														int socktype);
+	// Waits at most timeout_ms (-1 for no limit); a lookup still running
+	// then gives an empty result as a failed one does
+	ResolvedAddresses resolve(const std::string& host, const std::string& port,
+							  int socktype, std::int64_t timeout_ms = -1);
+
+   private:
+	struct Entry {
+		std::shared_future<ResolvedAddresses> result;
+		std::chrono::steady_clock::time_point expiry;
+		bool refreshing = false;
+	};
+
+	std::shared_future<ResolvedAddresses> start_lookup(const std::string& key,
+													   const std::string& host,
+													   const std::string& port,
+													   int socktype);
+	void worker();
+
+	std::chrono::seconds ttl_;
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::unordered_map<std::string, Entry> cache_;
+	std::queue<std::function<void()>> jobs_;
+	std::vector<std::thread> workers_;
+	bool stopping_ = false;
+};
+
+// Connects a non-blocking TCP socket to host:port, racing the resolved
+// addresses happy eyeballs style (RFC 8305): address families alternate
+// and a new attempt starts every 250 ms or as soon as the previous one
+// fails; the first connection to complete wins. Throws std::system_error
+// when no address can be reached within timeout_ms (-1 for none).
+// connect_tcp resolves host within the same timeout.
+int connect_happy_eyeballs(const ResolvedAddresses& addresses,
+						   std::int64_t timeout_ms);
+int connect_tcp(const std::string& host, const std::string& port,
+				std::int64_t timeout_ms);
+
+#endif	// RESOLVER_HPP
@@ -0,0 +1,250 @@
+#include "resume_data.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+#include "util.hpp"
+
+namespace {
+
+constexpr char MAGIC[4] = {'B', 'T', 'R', 'D'};
+constexpr std::uint8_t VERSION = 1;
+// size, mtime
+constexpr size_t FILE_RECORD_SIZE = 8 + 8;
+
+// fields are stored little-endian
+template <typename T>
+void put(std::vector<char>& out, T value) {
+	for (size_t i = 0; i < sizeof(T); i++) {
+		out.push_back(
+			static_cast<char>(static_cast<std::uint64_t>(value) >> (8 * i)));
+	}
+}
+
+// Reads from the loaded file, failing instead of running past its end
+class Input {
+   public:
+	Input(const char* in, const char* end) : in_(in), end_(end) {}
+
+	template <typename T>
+	bool get(T& value) {
+		if ((size_t)(end_ - in_) < sizeof(T)) {
+			return false;
+		}
+		std::uint64_t bits = 0;
+		for (size_t i = 0; i < sizeof(T); i++) {
+			bits |= std::uint64_t(static_cast<std::uint8_t>(*in_++)) << (8 * i);
+		}
+		value = static_cast<T>(bits);
+		return true;
+	}
+
+	// a bitfield of count bits, high bit of the first byte first
+	bool get_bits(std::vector<bool>& bits, size_t count) {
+		if ((size_t)(end_ - in_) < (count + 7) / 8) {
+			return false;
+		}
+		bits.assign(count, false);
+		for (size_t i = 0; i < count; i++) {
+			bits[i] = static_cast<std::uint8_t>(in_[i / 8]) >> (7 - i % 8) & 1;
+		}
+		in_ += (count + 7) / 8;
+		return true;
+	}
+
+   private:
+	const char* in_;
+	const char* end_;
+};
+
+void put_bits(std::vector<char>& out, const std::vector<bool>& bits) {
+	size_t first = out.size();
+	out.resize(first + (bits.size() + 7) / 8, 0);
+	for (size_t i = 0; i < bits.size(); i++) {
+		if (bits[i]) {
+			out[first + i / 8] |= static_cast<char>(0x80 >> (i % 8));
+		}
+	}
+}
+
+// Writes and fsyncs the whole file
+bool write_file(const std::string& path, const std::vector<char>& data) {
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+	size_t written = 0;
+	while (written < data.size()) {
+		ssize_t done = write(fd, data.data() + written, data.size() - written);
+		if (done < 0 && errno == EINTR) {
+			continue;
+		}
+		if (done < 0) {
+			break;
+		}
+		written += done;
+	}
+	bool ok = written == data.size() && fsync(fd) == 0;
+	return close(fd) == 0 && ok;
+}
+
+}  // namespace
+
+ResumeData::ResumeData(const std::string& info_hash,
+					   std::uint32_t piece_count,
+					   const std::vector<StorageFile>& files)
+	: pieces_(piece_count, false) {
+	std::filesystem::path dir =
+		std::filesystem::path(get_cache_dir()) / "resume";
+	std::error_code ec;
+	std::filesystem::create_directories(dir, ec);
+	path_ = (dir / byte_string_to_hex(info_hash)).string();
+	for (const StorageFile& file : files) {
+		file_paths_.push_back(file.path);
+		found_files_.push_back(stat_file(file.path));
+	}
+
+	std::ifstream file(path_, std::ios::binary);
+	std::vector<char> data{std::istreambuf_iterator<char>(file),
+						   std::istreambuf_iterator<char>()};
+	if (data.size() < sizeof(MAGIC) + 1 ||
+		std::memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0 ||
+		data[sizeof(MAGIC)] != VERSION) {
+		return;
+	}
+	Input in(data.data() + sizeof(MAGIC) + 1, data.data() + data.size());
+	// a file for another layout, or cut short, is ignored as a whole
+	std::uint32_t count;
+	std::vector<bool> pieces;
+	if (!in.get(count) || count != piece_count ||
+		!in.get_bits(pieces, count) || !in.get(count) ||
+		count != files.size()) {
+		return;
+	}
+	std::vector<FileState> saved_files(count);
+	for (FileState& state : saved_files) {
+		if (!in.get(state.size) || !in.get(state.mtime)) {
+			return;
+		}
+	}
+	std::vector<PartialPiece> partial;
+	if (!in.get(count)) {
+		return;
+	}
+	for (std::uint32_t i = 0; i < count; i++) {
+		PartialPiece piece;
+		std::uint32_t blocks;
+		if (!in.get(piece.piece) || !in.get(blocks) ||
+			!in.get_bits(piece.blocks, blocks)) {
+			return;
+		}
+		partial.push_back(std::move(piece));
+	}
+	pieces_ = std::move(pieces);
+	saved_files_ = std::move(saved_files);
+	partial_ = std::move(partial);
+}
+
+std::vector<bool> ResumeData::check(const TorrentLayout& layout,
+									Storage& storage) {
+	std::vector<bool> unchanged(found_files_.size(), false);
+	if (saved_files_.size() == found_files_.size()) {
+		for (size_t i = 0; i < unchanged.size(); i++) {
+			unchanged[i] = found_files_[i].size >= 0 &&
+						   found_files_[i] == saved_files_[i];
+		}
+	}
+	std::vector<bool> done(pieces_.size(), false);
+	std::vector<bool> trusted(pieces_.size(), false);
+	std::vector<char> buffer;
+	for (std::uint32_t piece = 0; piece < pieces_.size(); piece++) {
+		std::int64_t offset = (std::int64_t)piece * layout.piece_length;
+		std::int64_t size = layout.piece_size(piece);
+		std::vector<Storage::Span> spans = storage.spans(offset, size);
+		trusted[piece] = std::all_of(
+			spans.begin(), spans.end(),
+			[&](const Storage::Span& span) { return unchanged[span.file]; });
+		if (trusted[piece]) {
+			done[piece] = pieces_[piece];
+			continue;
+		}
+		// only a file that had data where the piece is can hold it
+		bool had_data = std::any_of(
+			spans.begin(), spans.end(), [&](const Storage::Span& span) {
+				return found_files_[span.file].size > span.file_offset;
+			});
+		if (!had_data) {
+			continue;
+		}
+		buffer.resize(size);
+		done[piece] = storage.read(offset, buffer.data(), size) &&
+					  sha1_hash(buffer.data(), size) ==
+						  byte_string_to_hex(layout.piece_hash(piece));
+	}
+	std::erase_if(partial_, [&](const PartialPiece& partial) {
+		return partial.piece >= pieces_.size() || !trusted[partial.piece] ||
+			   done[partial.piece];
+	});
+	pieces_ = done;
+	return done;
+}
+
+void ResumeData::set_piece(std::uint32_t piece) {
+	if (piece < pieces_.size()) {
+		pieces_[piece] = true;
+	}
+}
+
+void ResumeData::set_partial_pieces(std::vector<PartialPiece> partial) {
+	partial_ = std::move(partial);
+}
+
+void ResumeData::save() {
+	saved_files_.clear();
+	for (const std::string& path : file_paths_) {
+		saved_files_.push_back(stat_file(path));
+	}
+
+	std::vector<char> data(MAGIC, MAGIC + sizeof(MAGIC));
+	data.reserve(sizeof(MAGIC) + 1 + 4 + (pieces_.size() + 7) / 8 + 4 +
+				 saved_files_.size() * FILE_RECORD_SIZE + 4);
+	put<std::uint8_t>(data, VERSION);
+	put<std::uint32_t>(data, pieces_.size());
+	put_bits(data, pieces_);
+	put<std::uint32_t>(data, saved_files_.size());
+	for (const FileState& state : saved_files_) {
+		put<std::int64_t>(data, state.size);
+		put<std::int64_t>(data, state.mtime);
+	}
+	put<std::uint32_t>(data, partial_.size());
+	for (const PartialPiece& partial : partial_) {
+		put<std::uint32_t>(data, partial.piece);
+		put<std::uint32_t>(data, partial.blocks.size());
+		put_bits(data, partial.blocks);
+	}
+
+	// on disk before the rename, so the name never points at a file the
+	// kernel has not written yet
+	std::string tmp_path = path_ + ".tmp";
+	if (write_file(tmp_path, data)) {
+		std::rename(tmp_path.c_str(), path_.c_str());
+	}
+}
+
+ResumeData::FileState ResumeData::stat_file(const std::string& path) {
+	struct stat st;
+	if (stat(path.c_str(), &st) < 0) {
+		return {};
+	}
+	return {st.st_size, (std::int64_t)st.st_mtim.tv_sec * 1000000000 +
+							st.st_mtim.tv_nsec};
+}
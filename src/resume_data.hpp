@@ -0,0 +1,58 @@
+#ifndef RESUME_DATA_HPP
+#define RESUME_DATA_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "peer_engine.hpp"
+#include "storage.hpp"
+#include "torrent.hpp"
+
+// What an interrupted download has on disk, kept between runs in a binary
+// file in the cache directory: the verified pieces, the blocks of pieces
+// in progress, and the size and mtime every file had when that was saved.
+// On restart a piece whose files all still have that size and mtime is
+// taken as it is; only the pieces of files that changed are hashed again.
+class ResumeData {
+   public:
+	// Reads the torrent's resume file, if any, and looks at the files
+	// before they are opened (opening and allocating may touch mtime)
+	ResumeData(const std::string& info_hash, std::uint32_t piece_count,
+			   const std::vector<StorageFile>& files);
+
+	// The pieces already on disk: saved ones trusted where their files are
+	// unchanged, the rest of the pieces in files that had data hashed
+	std::vector<bool> check(const TorrentLayout& layout, Storage& storage);
+	// Saved pieces in progress whose files are unchanged, after check()
+	const std::vector<PartialPiece>& partial_pieces() const {
+		return partial_;
+	}
+
+	void set_piece(std::uint32_t piece);
+	void set_partial_pieces(std::vector<PartialPiece> partial);
+
+	// Records every file's size and mtime and replaces the resume file
+	// atomically. Everything set must be synced to the files by now,
+	// later writes move the mtimes on and get the files hashed again.
+	void save();
+
+   private:
+	struct FileState {
+		std::int64_t size = -1;	  // -1 if the file did not exist
+		std::int64_t mtime = 0;	  // nanoseconds
+		bool operator==(const FileState&) const = default;
+	};
+
+	static FileState stat_file(const std::string& path);
+
+	std::string path_;
+	std::vector<std::string> file_paths_;
+	std::vector<bool> pieces_;
+	std::vector<PartialPiece> partial_;
+	// as saved, and as found on startup
+	std::vector<FileState> saved_files_;
+	std::vector<FileState> found_files_;
+};
+
+#endif	// RESUME_DATA_HPP
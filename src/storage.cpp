@@ -0,0 +1,278 @@
+#include "storage.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <filesystem>
+#include <system_error>
+
+namespace {
+
+// torrents with more files than this are written through an fd cache
+constexpr size_t MAX_OPEN_FILES = 256;
+
+// pwritev, or preadv, until every buffer is done, IOV_MAX at a time
+template <typename Transfer>
+bool transfer_all(Transfer transfer, int fd, std::int64_t offset, iovec* iov,
+				  int count) {
+	while (count > 0) {
+		ssize_t done = transfer(fd, iov, std::min(count, IOV_MAX), offset);
+		if (done < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		if (done == 0) {
+			// end of file on a read
+			errno = EIO;
+			return false;
+		}
+		offset += done;
+		// skip what is done, a short transfer leaves the rest of one buffer
+		while (count > 0 && (size_t)done >= iov->iov_len) {
+			done -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+			iov->iov_len -= done;
+		}
+	}
+	return true;
+}
+
+}  // namespace
+
+Storage::Storage(const std::vector<StorageFile>& files, bool keep_existing) {
+	int flags = O_RDWR | O_CREAT | O_CLOEXEC | (keep_existing ? 0 : O_TRUNC);
+	std::int64_t offset = 0;
+	for (const StorageFile& file : files) {
+		std::filesystem::path path(file.path);
+		std::error_code ec;
+		if (path.has_parent_path()) {
+			std::filesystem::create_directories(path.parent_path(), ec);
+		}
+		int fd = open(file.path.c_str(), flags, 0644);
+		if (fd < 0) {
+			int error = errno;
+			close();
+			throw std::system_error{error, std::system_category(), file.path};
+		}
+		files_.push_back({-1, offset, file.length, file.path});
+		keep_open(files_.size() - 1, fd);
+		offset += file.length;
+	}
+}
+
+Storage::~Storage() { close(); }
+
+bool Storage::allocate(Allocation allocation) {
+	if (allocation == Allocation::sparse && !files_.empty()) {
+		// a sparse file would only run out of room once the data comes;
+		// blocks resumed files hold already are not needed again
+		std::int64_t missing = 0;
+		for (size_t i = 0; i < files_.size(); i++) {
+			struct stat st;
+			std::int64_t allocated =
+				fstat(fd(i), &st) == 0 ? (std::int64_t)st.st_blocks * 512 : 0;
+			missing += std::max<std::int64_t>(files_[i].length - allocated, 0);
+		}
+		struct statvfs fs;
+		if (fstatvfs(fd(0), &fs) == 0 &&
+			(std::int64_t)fs.f_bavail * (std::int64_t)fs.f_frsize < missing) {
+			errno = ENOSPC;
+			return false;
+		}
+	}
+	for (size_t i = 0; i < files_.size(); i++) {
+		const File& file = files_[i];
+		if (allocation == Allocation::sparse || file.length == 0) {
+			if (ftruncate(fd(i), file.length) < 0) {
+				return false;
+			}
+			continue;
+		}
+		// fallocate, or writing zeroes where the filesystem cannot
+		int error = posix_fallocate(fd(i), 0, file.length);
+		if (error != 0) {
+			errno = error;
+			return false;
+		}
+	}
+	return true;
+}
+
+std::vector<Storage::Span> Storage::spans(std::int64_t offset,
+										  std::int64_t length) const {
+	std::vector<Span> spans;
+	// the last file starting at or before offset; with empty files at the
+	// same offset that is the one holding data
+	auto file = std::upper_bound(files_.begin(), files_.end(), offset,
+								 [](std::int64_t offset, const File& file) {
+									 return offset < file.offset;
+								 });
+	if (file == files_.begin()) {
+		return spans;
+	}
+	for (--file; length > 0 && file != files_.end(); ++file) {
+		std::int64_t file_offset = offset - file->offset;
+		std::int64_t span = std::min(length, file->length - file_offset);
+		if (span <= 0) {
+			continue;
+		}
+		spans.push_back({(size_t)(file - files_.begin()), file_offset, span});
+		offset += span;
+		length -= span;
+	}
+	return spans;
+}
+
+bool Storage::write(std::int64_t offset, const char* data, size_t size) {
+	iovec iov{const_cast<char*>(data), size};
+	return writev(offset, &iov, 1);
+}
+
+bool Storage::writev(std::int64_t offset, iovec* iov, int count) {
+	std::int64_t length = 0;
+	for (int i = 0; i < count; i++) {
+		length += iov[i].iov_len;
+	}
+	std::vector<iovec> part;
+	for (const Span& span : spans(offset, length)) {
+		// the buffers, or the parts of them, that go to this file
+		part.clear();
+		std::int64_t left = span.length;
+		while (left > 0) {
+			size_t take = std::min<std::int64_t>(iov->iov_len, left);
+			if (take > 0) {
+				part.push_back({iov->iov_base, take});
+			}
+			iov->iov_base = static_cast<char*>(iov->iov_base) + take;
+			iov->iov_len -= take;
+			left -= take;
+			if (iov->iov_len == 0) {
+				iov++;
+			}
+		}
+		if (!files_[span.file].unsynced) {
+			files_[span.file].unsynced = true;
+			unsynced_files_.push_back(span.file);
+		}
+		if (!transfer_all(pwritev, fd(span.file), span.file_offset,
+						  part.data(), part.size())) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Storage::read(std::int64_t offset, char* data, size_t size) {
+	for (const Span& span : spans(offset, size)) {
+		iovec iov{data, (size_t)span.length};
+		if (!transfer_all(preadv, fd(span.file), span.file_offset, &iov, 1)) {
+			return false;
+		}
+		data += span.length;
+		size -= span.length;
+	}
+	if (size > 0) {
+		// past the end of the last file
+		errno = EIO;
+		return false;
+	}
+	return true;
+}
+
+char* Storage::map() {
+	if (files_.size() != 1) {
+		errno = ENOTSUP;
+		return nullptr;
+	}
+	const File& file = files_.front();
+	if (file.length == 0) {
+		errno = EINVAL;
+		return nullptr;
+	}
+	void* mapping = mmap(nullptr, file.length, PROT_READ | PROT_WRITE,
+						 MAP_SHARED, fd(0), 0);
+	if (mapping == MAP_FAILED) {
+		return nullptr;
+	}
+	mapping_ = static_cast<char*>(mapping);
+	mapping_length_ = file.length;
+	return mapping_;
+}
+
+bool Storage::flush_range(std::int64_t offset, std::int64_t length) {
+	return sync_file_range(fd(0), offset, length, SYNC_FILE_RANGE_WRITE) == 0;
+}
+
+bool Storage::sync() {
+	if (mapping_ && msync(mapping_, mapping_length_, MS_SYNC) < 0) {
+		return false;
+	}
+	// a file the cache closed meanwhile still has its pages to write
+	while (!unsynced_files_.empty()) {
+		size_t file = unsynced_files_.back();
+		int file_fd = fd(file);
+		if (file_fd < 0 || fdatasync(file_fd) < 0) {
+			return false;
+		}
+		files_[file].unsynced = false;
+		unsynced_files_.pop_back();
+	}
+	return true;
+}
+
+bool Storage::close() {
+	bool ok = true;
+	if (mapping_) {
+		// errors writing back a mapping only show up here
+		ok = msync(mapping_, mapping_length_, MS_SYNC) == 0;
+		munmap(mapping_, mapping_length_);
+		mapping_ = nullptr;
+	}
+	for (size_t file : open_files_) {
+		if (::close(files_[file].fd) < 0) {
+			ok = false;
+		}
+		files_[file].fd = -1;
+	}
+	open_files_.clear();
+	return ok && !close_failed_;
+}
+
+// The file's descriptor, reopened if the cache closed it; -1 with errno
+// set on failure
+int Storage::fd(size_t file) {
+	if (files_[file].fd < 0) {
+		int fd = open(files_[file].path.c_str(), O_RDWR | O_CLOEXEC);
+		if (fd < 0) {
+			return -1;
+		}
+		keep_open(file, fd);
+	}
+	return files_[file].fd;
+}
+
+// Past MAX_OPEN_FILES the file opened longest ago is closed
+void Storage::keep_open(size_t file, int fd) {
+	if (open_files_.size() >= MAX_OPEN_FILES) {
+		size_t oldest = open_files_.front();
+		open_files_.pop_front();
+		if (::close(files_[oldest].fd) < 0) {
+			close_failed_ = true;
+		}
+		files_[oldest].fd = -1;
+	}
+	files_[file].fd = fd;
+	open_files_.push_back(file);
+}
@@ -0,0 +1,103 @@
+#ifndef STORAGE_HPP
+#define STORAGE_HPP
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+struct StorageFile {
+	std::string path;
+	std::int64_t length = 0;
+};
+
+// The files a download goes to, seen as one byte range: the files of a
+// torrent back to back, in torrent order. Every file is opened once and
+// every write lands at its absolute offset with pwrite, so pieces can
+// arrive in any order and from any number of peers without seeking or
+// reopening. A range is turned into per-file spans by a binary search over
+// the sorted file offsets, and a read or write touching several files
+// does one vectored call per file. Torrents with very many files keep
+// only the most recently opened ones open.
+//
+// Alternatively a single file is mapped and data is put straight into
+// the mapping; the page cache does the buffering, completed ranges are
+// pushed towards the disk with sync_file_range and close() msyncs the rest.
+class Storage {
+   public:
+	enum class Allocation {
+		sparse,	 // only sized, blocks are allocated as data arrives
+		full	 // every block reserved up front, which keeps it contiguous
+	};
+
+	// Where part of the byte range lives
+	struct Span {
+		size_t file;
+		std::int64_t file_offset;
+		std::int64_t length;
+	};
+
+	// Creates every file, and the directories they are in. Existing files
+	// are truncated unless keep_existing, for resuming into them.
+	// Throws std::system_error on failure.
+	explicit Storage(const std::vector<StorageFile>& files,
+					 bool keep_existing = false);
+	~Storage();
+	Storage(const Storage&) = delete;
+	Storage& operator=(const Storage&) = delete;
+
+	// Gives every file its final size, keeping data already in it. Either
+	// way a disk without room for the rest fails here (ENOSPC) rather than
+	// halfway through.
+	bool allocate(Allocation allocation);
+
+	// The files under [offset, offset + length), in order
+	std::vector<Span> spans(std::int64_t offset, std::int64_t length) const;
+
+	// Writes all of data at offset; false with errno set on failure
+	bool write(std::int64_t offset, const char* data, size_t size);
+	// The buffers back to back from offset, one pwritev per file. The
+	// iovecs are consumed.
+	bool writev(std::int64_t offset, iovec* iov, int count);
+	// Fills data from offset, false with errno set on failure or when the
+	// files are shorter
+	bool read(std::int64_t offset, char* data, size_t size);
+
+	// Maps all of a single, allocated file, nullptr with errno set on
+	// failure, if there are several files or if the file is empty
+	char* map();
+	// Starts writeback of a range of the mapping without waiting for it
+	bool flush_range(std::int64_t offset, std::int64_t length);
+
+	// Waits until everything written so far, through writes or the
+	// mapping, is on the disk; false with errno set on failure
+	bool sync();
+
+	// Closes the files, reporting errors of writes the kernel deferred
+	bool close();
+
+   private:
+	struct File {
+		int fd = -1;  // -1 while closed
+		std::int64_t offset = 0;  // where it starts in the byte range
+		std::int64_t length = 0;
+		std::string path;
+		bool unsynced = false;	// written since the last sync()
+	};
+
+	int fd(size_t file);
+	void keep_open(size_t file, int fd);
+
+	std::vector<File> files_;
+	std::deque<size_t> open_files_;	 // oldest first
+	// files written since the last sync(), open or not
+	std::vector<size_t> unsynced_files_;
+	bool close_failed_ = false;
+	char* mapping_ = nullptr;
+	std::int64_t mapping_length_ = 0;
+};
+
+#endif	// STORAGE_HPP
@@ -0,0 +1,126 @@
+#include "torrent.hpp"
+
+#include <algorithm>
+#include <random>
+
+#include "util.hpp"
+
+json parse_torrent_file(const std::string& filename) {
+	std::string encoded_torrent_meta = read_file(filename);
+	json decoded_torrent_meta = decode_bencoded_value(encoded_torrent_meta);
+
+	return decoded_torrent_meta;
+}
+
+std::string get_tracker_url(const json& decoded_meta) {
+	return decoded_meta.value("announce", "");
+}
+
+std::vector<std::vector<std::string>> get_announce_tiers(
+	const json& decoded_meta) {
+	std::vector<std::vector<std::string>> tiers;
+	auto announce_list = decoded_meta.find("announce-list");
+	if (announce_list != decoded_meta.end() && announce_list->is_array()) {
+		std::mt19937 rng{std::random_device{}()};
+		for (const json& tier : *announce_list) {
+			if (!tier.is_array()) {
+				continue;
+			}
+			std::vector<std::string> urls;
+			for (const json& url : tier) {
+				if (url.is_string()) {
+					urls.push_back(url.get<std::string>());
+				}
+			}
+			if (!urls.empty()) {
+				std::shuffle(urls.begin(), urls.end(), rng);
+				tiers.push_back(std::move(urls));
+			}
+		}
+	}
+	// announce is ignored when announce-list is present (BEP 12)
+	if (tiers.empty()) {
+		std::string tracker_url = get_tracker_url(decoded_meta);
+		if (!tracker_url.empty()) {
+			tiers.push_back({tracker_url});
+		}
+	}
+	return tiers;
+}
+
+std::int64_t get_length(const json& decoded_meta) {
+	const json& info = decoded_meta["info"];
+	auto files = info.find("files");
+	if (files == info.end()) {
+		return info["length"];
+	}
+	std::int64_t length = 0;
+	for (const json& file : *files) {
+		length += file["length"].get<std::int64_t>();
+	}
+	return length;
+}
+
+std::string get_info_hash(const json& decoded_meta) {
+	json info = decoded_meta["info"];
+	std::string encoded_info = json_to_bencode(info);
+	return sha1_hash(encoded_info);
+}
+
+namespace {
+
+// A path component that stays inside the download directory: separators
+// are replaced, "." and ".." dropped (empty)
+std::string safe_path_component(std::string component) {
+	if (component == "." || component == "..") {
+		return "";
+	}
+	std::replace(component.begin(), component.end(), '/', '_');
+	return component;
+}
+
+}  // namespace
+
+std::uint32_t TorrentLayout::piece_count() const {
+	return piece_hashes.size() / 20;
+}
+
+std::int64_t TorrentLayout::piece_size(std::uint32_t piece) const {
+	return std::min(piece_length, total_length - piece * piece_length);
+}
+
+std::string TorrentLayout::piece_hash(std::uint32_t piece) const {
+	return piece_hashes.substr(piece * 20, 20);
+}
+
+TorrentLayout get_torrent_layout(const json& decoded_meta) {
+	const json& info = decoded_meta["info"];
+	TorrentLayout layout;
+	layout.info_hash = hex_string_to_bytes(get_info_hash(decoded_meta));
+	layout.total_length = get_length(decoded_meta);
+	layout.piece_length = info["piece length"];
+	layout.piece_hashes = info["pieces"];
+	std::string name = info.value("name", "");
+	auto files = info.find("files");
+	if (files == info.end()) {
+		layout.files.push_back(
+			{{safe_path_component(name)}, layout.total_length});
+		return layout;
+	}
+	layout.multi_file = true;
+	for (const json& file : *files) {
+		TorrentFile torrent_file;
+		for (const json& component : file["path"]) {
+			std::string safe = safe_path_component(component);
+			if (!safe.empty()) {
+				torrent_file.path.push_back(std::move(safe));
+			}
+		}
+		if (torrent_file.path.empty()) {
+			torrent_file.path.push_back("_");
+		}
+		torrent_file.length = file["length"];
+		layout.files.push_back(std::move(torrent_file));
+	}
+	return layout;
+}
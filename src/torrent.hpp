@@ -0,0 +1,45 @@
+#ifndef TORRENT_HPP
+#define TORRENT_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bencode.hpp"
+
+json parse_torrent_file(const std::string& filename);
+
+std::string get_tracker_url(const json& decoded_meta);
+// BEP 12 tiers from announce-list, falling back to a single tier holding
+// announce. Trackers within a tier are shuffled as the spec asks.
+std::vector<std::vector<std::string>> get_announce_tiers(
+	const json& decoded_meta);
+// total of all files for a multi-file torrent
+std::int64_t get_length(const json& decoded_meta);
+std::string get_info_hash(const json& decoded_meta);
+
+struct TorrentFile {
+	// relative to the torrent's root directory, unsafe components removed;
+	// just the name for a single-file torrent
+	std::vector<std::string> path;
+	std::int64_t length = 0;
+};
+
+// The parts of the metainfo the peer wire code needs
+struct TorrentLayout {
+	std::string info_hash;	// raw 20 bytes
+	std::int64_t total_length = 0;
+	std::int64_t piece_length = 0;
+	std::string piece_hashes;  // raw SHA-1 of every piece, concatenated
+	// in torrent order, their data back to back makes up the pieces
+	std::vector<TorrentFile> files;
+	bool multi_file = false;
+
+	std::uint32_t piece_count() const;
+	std::int64_t piece_size(std::uint32_t piece) const;
+	std::string piece_hash(std::uint32_t piece) const;
+};
+
+TorrentLayout get_torrent_layout(const json& decoded_meta);
+
+#endif	// TORRENT_HPP
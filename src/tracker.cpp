@@ -0,0 +1,456 @@
+#include "tracker.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "lib/http/HTTPRequest.hpp"
+#include "resolver.hpp"
+#include "torrent.hpp"
+#include "udp_tracker.hpp"
+#include "util.hpp"
+
+namespace {
+
+constexpr std::chrono::milliseconds TRACKER_TIMEOUT{15000};
+// two attempts (15 s + 30 s), other trackers of the tier race meanwhile
+const UdpTrackerOptions UDP_TRACKER_OPTIONS{std::chrono::milliseconds{15000},
+										   1};
+
+// Success/failure counts per tracker URL, kept in the cache directory as
+// "<successes> <failures> <url>" lines.
+class TrackerStats {
+   public:
+	TrackerStats() : path_(get_cache_dir() + "/tracker_stats") {
+		std::ifstream file(path_);
+		std::int64_t successes, failures;
+		std::string url;
+		while (file >> successes >> failures >> std::ws &&
+			   std::getline(file, url)) {
+			counts_[url] = {successes, failures};
+		}
+	}
+
+	void record(const std::string& url, bool ok) {
+		auto& count = counts_[url];
+		(ok ? count.first : count.second)++;
+	}
+
+	// Laplace-smoothed, so unknown trackers rank between good and bad ones
+	double success_rate(const std::string& url) const {
+		auto it = counts_.find(url);
+		if (it == counts_.end()) {
+			return 0.5;
+		}
+		return (it->second.first + 1.0) /
+			   (it->second.first + it->second.second + 2.0);
+	}
+
+	void save() const {
+		std::string tmp_path = path_ + ".tmp";
+		std::ofstream file(tmp_path, std::ios::trunc);
+		for (const auto& [url, count] : counts_) {
+			file << count.first << ' ' << count.second << ' ' << url << '\n';
+		}
+		file.close();
+		if (file) {
+			std::rename(tmp_path.c_str(), path_.c_str());
+		}
+	}
+
+   private:
+	std::string path_;
+	std::map<std::string, std::pair<std::int64_t, std::int64_t>> counts_;
+};
+
+// Fills an AnnounceResponse from the top level of a reply as it streams
+// in; peers and peers6 are decoded the moment their string is complete
+class AnnounceHandler : public BencodeHandler {
+   public:
+	explicit AnnounceHandler(AnnounceResponse& response)
+		: response_(response) {}
+
+	void on_key(std::string_view key) override { key_ = key; }
+
+	void on_integer(std::int64_t value) override {
+		if (depth_ != 1) {
+			return;
+		}
+		if (key_ == "interval") {
+			response_.interval = value;
+		} else if (key_ == "min interval") {
+			response_.min_interval = value;
+		} else if (key_ == "complete") {
+			response_.seeders = value;
+		} else if (key_ == "incomplete") {
+			response_.leechers = value;
+		}
+	}
+
+	void on_string(std::string_view value) override {
+		if (depth_ != 1) {
+			return;
+		}
+		if (key_ == "peers") {
+			decode_compact_peers(value, response_.peers);
+			has_peers_ = true;
+		} else if (key_ == "peers6") {
+			decode_compact_peers6(value, response_.peers);
+			has_peers_ = true;
+		} else if (key_ == "failure reason") {
+			response_.failure_reason = value;
+		}
+	}
+
+	void on_dict_begin() override { depth_++; }
+	void on_list_begin() override { depth_++; }
+	void on_end() override { depth_--; }
+
+	bool has_peers() const { return has_peers_; }
+
+   private:
+	AnnounceResponse& response_;
+	int depth_ = 0;
+	bool has_peers_ = false;
+	std::string key_;
+};
+
+// info_hash parameters per scrape request, keeps URLs around 8 KiB
+constexpr size_t SCRAPE_BATCH = 128;
+
+// Picks the per-torrent counters out of a scrape reply:
+// d5:filesd<20-byte hash>d8:completei..e10:downloadedi..e10:incompletei..eeee
+class ScrapeHandler : public BencodeHandler {
+   public:
+	void on_key(std::string_view key) override {
+		if (in_files_ && depth_ == 2) {
+			current_ = &counts[std::string(key)];
+		} else {
+			key_ = key;
+		}
+	}
+
+	void on_integer(std::int64_t value) override {
+		if (!in_files_ || depth_ != 3 || !current_) {
+			return;
+		}
+		if (key_ == "complete") {
+			current_->seeders = value;
+		} else if (key_ == "downloaded") {
+			current_->completed = value;
+		} else if (key_ == "incomplete") {
+			current_->leechers = value;
+		}
+	}
+
+	void on_string(std::string_view value) override {
+		if (depth_ == 1 && key_ == "failure reason") {
+			failure_reason = value;
+		}
+	}
+
+	void on_dict_begin() override {
+		depth_++;
+		if (depth_ == 2 && key_ == "files") {
+			in_files_ = true;
+		}
+	}
+
+	void on_list_begin() override { depth_++; }
+
+	void on_end() override {
+		if (depth_ == 2) {
+			in_files_ = false;
+		}
+		depth_--;
+	}
+
+	std::unordered_map<std::string, ScrapeResult> counts;
+	std::string failure_reason;
+
+   private:
+	int depth_ = 0;
+	bool in_files_ = false;
+	std::string key_;
+	ScrapeResult* current_ = nullptr;
+};
+
+// Starts DNS lookups for every tracker so that later tiers are resolved
+// while the first one is being tried
+void prefetch_tracker_hosts(const std::vector<std::vector<std::string>>& tiers) {
+	for (const std::vector<std::string>& tier : tiers) {
+		for (const std::string& url : tier) {
+			size_t scheme_end = url.find("://");
+			if (scheme_end == std::string::npos) {
+				continue;
+			}
+			std::string authority = url.substr(scheme_end + 3);
+			authority = authority.substr(0, authority.find('/'));
+			bool udp = url.starts_with("udp://");
+			std::string host = authority, port = udp ? "" : "80";
+			size_t colon_index = authority.rfind(':');
+			if (colon_index != std::string::npos &&
+				authority.find(']', colon_index) == std::string::npos) {
+				host = authority.substr(0, colon_index);
+				port = authority.substr(colon_index + 1);
+			}
+			if (host.starts_with('[') && host.ends_with(']')) {
+				host = host.substr(1, host.size() - 2);
+			}
+			Resolver::instance().resolve_async(
+				host, port, udp ? SOCK_DGRAM : SOCK_STREAM);
+		}
+	}
+}
+
+struct TierState {
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::vector<AnnounceResponse> results;
+	size_t pending = 0;
+};
+
+}  // namespace
+
+AnnounceResponse announce_http(const std::string& tracker_url,
+							   const AnnounceRequest& request) {
+	AnnounceResponse result;
+	result.tracker_url = tracker_url;
+	std::string request_url =
+		tracker_url +
+		(tracker_url.find('?') == std::string::npos ? "?" : "&") +
+		"info_hash=" + url_encode(request.info_hash) +
+		"&peer_id=" + url_encode(request.peer_id) +
+		"&port=" + std::to_string(request.port) +
+		"&uploaded=" + std::to_string(request.uploaded) +
+		"&downloaded=" + std::to_string(request.downloaded) +
+		"&left=" + std::to_string(request.left) + "&compact=1";
+	switch (request.event) {
+		case AnnounceEvent::started:
+			request_url += "&event=started";
+			break;
+		case AnnounceEvent::completed:
+			request_url += "&event=completed";
+			break;
+		case AnnounceEvent::stopped:
+			request_url += "&event=stopped";
+			break;
+		case AnnounceEvent::none:
+			break;
+	}
+	if (request.numwant >= 0) {
+		request_url += "&numwant=" + std::to_string(request.numwant);
+	}
+	try {
+		AnnounceHandler handler(result);
+		BencodeParser parser(handler);
+		http::Request http_request(request_url);
+		http_request.setConnector(connect_tcp);
+		http_request.setBodyHandler(
+			[&parser](const std::uint8_t* data, std::size_t size) {
+				parser.feed(reinterpret_cast<const char*>(data), size);
+			});
+		http_request.send("GET", "", {}, TRACKER_TIMEOUT);
+		if (!parser.done()) {
+			result.failure_reason = "Truncated tracker reply";
+			return result;
+		}
+		if (!result.failure_reason.empty()) {
+			return result;
+		}
+		if (!handler.has_peers()) {
+			result.failure_reason = "no compact peers in reply";
+			return result;
+		}
+		result.ok = true;
+	} catch (const std::exception& e) {
+		result.failure_reason = e.what();
+	}
+	return result;
+}
+
+AnnounceResponse announce(const std::string& tracker_url,
+						  const AnnounceRequest& request) {
+	if (tracker_url.starts_with("udp://")) {
+		return announce_udp(tracker_url, request, UDP_TRACKER_OPTIONS);
+	}
+	return announce_http(tracker_url, request);
+}
+
+AnnounceResponse announce_tiers(std::vector<std::vector<std::string>>& tiers,
+								const AnnounceRequest& request) {
+	prefetch_tracker_hosts(tiers);
+	TrackerStats stats;
+	AnnounceResponse merged;
+	for (std::vector<std::string>& tier : tiers) {
+		std::stable_sort(tier.begin(), tier.end(),
+						 [&](const std::string& a, const std::string& b) {
+							 return stats.success_rate(a) >
+									stats.success_rate(b);
+						 });
+		// threads outlive this call when a slow tracker loses the race
+		auto state = std::make_shared<TierState>();
+		state->pending = tier.size();
+		for (const std::string& url : tier) {
+			std::thread([state, url, request] {
+				AnnounceResponse response = announce(url, request);
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->results.push_back(std::move(response));
+				state->pending--;
+				state->cv.notify_all();
+			}).detach();
+		}
+
+		std::unique_lock<std::mutex> lock(state->mutex);
+		state->cv.wait(lock, [&] {
+			return state->pending == 0 ||
+				   std::any_of(state->results.begin(), state->results.end(),
+							   [](const AnnounceResponse& r) { return r.ok; });
+		});
+
+		PeerEndpointSet seen;
+		for (const AnnounceResponse& response : state->results) {
+			stats.record(response.tracker_url, response.ok);
+			if (!response.ok) {
+				std::cerr << "Tracker " << response.tracker_url
+						  << " failed: " << response.failure_reason
+						  << std::endl;
+				continue;
+			}
+			if (!merged.ok) {
+				merged.ok = true;
+				merged.tracker_url = response.tracker_url;
+				merged.interval = response.interval;
+				merged.min_interval = response.min_interval;
+				// BEP 12: a tracker that answered moves to the front
+				auto winner = std::find(tier.begin(), tier.end(),
+										response.tracker_url);
+				std::rotate(tier.begin(), winner, winner + 1);
+			}
+			merged.peers.reserve(merged.peers.size() + response.peers.size());
+			for (const PeerEndpoint& peer : response.peers) {
+				if (seen.insert(peer).second) {
+					merged.peers.push_back(peer);
+				}
+			}
+		}
+		if (merged.ok) {
+			break;
+		}
+	}
+	stats.save();
+	if (!merged.ok) {
+		merged.failure_reason = "all trackers failed";
+	}
+	return merged;
+}
+
+std::string get_scrape_url(const std::string& tracker_url) {
+	size_t slash_index = tracker_url.rfind('/');
+	if (slash_index == std::string::npos ||
+		tracker_url.compare(slash_index + 1, 8, "announce") != 0) {
+		return "";
+	}
+	return tracker_url.substr(0, slash_index + 1) + "scrape" +
+		   tracker_url.substr(slash_index + 9);
+}
+
+ScrapeResponse scrape_http(const std::string& tracker_url,
+						   const std::vector<std::string>& info_hashes) {
+	ScrapeResponse response;
+	for (const std::string& info_hash : info_hashes) {
+		response.files.push_back({info_hash});
+	}
+	std::string scrape_url = get_scrape_url(tracker_url);
+	if (scrape_url.empty()) {
+		response.failure_reason = "Tracker does not support scrape";
+		return response;
+	}
+
+	for (size_t first = 0; first < info_hashes.size(); first += SCRAPE_BATCH) {
+		size_t last = std::min(first + SCRAPE_BATCH, info_hashes.size());
+		std::string request_url = scrape_url;
+		char separator = scrape_url.find('?') == std::string::npos ? '?' : '&';
+		for (size_t i = first; i < last; i++) {
+			request_url += separator;
+			request_url += "info_hash=" + url_encode(info_hashes[i]);
+			separator = '&';
+		}
+
+		ScrapeHandler handler;
+		try {
+			BencodeParser parser(handler);
+			http::Request http_request(request_url);
+			http_request.setConnector(connect_tcp);
+			http_request.setBodyHandler(
+				[&parser](const std::uint8_t* data, std::size_t size) {
+					parser.feed(reinterpret_cast<const char*>(data), size);
+				});
+			http_request.send("GET", "", {}, TRACKER_TIMEOUT);
+			if (!parser.done()) {
+				response.failure_reason = "Truncated tracker reply";
+				return response;
+			}
+		} catch (const std::exception& e) {
+			response.failure_reason = e.what();
+			return response;
+		}
+		if (!handler.failure_reason.empty()) {
+			response.failure_reason = handler.failure_reason;
+			return response;
+		}
+		for (size_t i = first; i < last; i++) {
+			auto it = handler.counts.find(info_hashes[i]);
+			if (it != handler.counts.end()) {
+				ScrapeResult& result = response.files[i];
+				result.ok = true;
+				result.seeders = it->second.seeders;
+				result.completed = it->second.completed;
+				result.leechers = it->second.leechers;
+			}
+		}
+	}
+	response.ok = true;
+	return response;
+}
+
+ScrapeResponse scrape(const std::string& tracker_url,
+					  const std::vector<std::string>& info_hashes) {
+	if (tracker_url.starts_with("udp://")) {
+		return scrape_udp(tracker_url, info_hashes, UDP_TRACKER_OPTIONS);
+	}
+	return scrape_http(tracker_url, info_hashes);
+}
+
+std::vector<PeerEndpoint> get_peer_list(const json& decoded_meta) {
+	std::vector<std::vector<std::string>> tiers =
+		get_announce_tiers(decoded_meta);
+	if (tiers.empty()) {
+		std::cerr << "No tracker in torrent file" << std::endl;
+		return {};
+	}
+	AnnounceRequest request;
+	request.info_hash = hex_string_to_bytes(get_info_hash(decoded_meta));
+	request.peer_id = "12345678901234567890";
+	request.left = get_length(decoded_meta);
+	AnnounceResponse response = announce_tiers(tiers, request);
+	if (!response.ok) {
+		std::cerr << "Failed to get peers: " << response.failure_reason
+				  << std::endl;
+		return {};
+	}
+	std::cout << "Tracker URL: " << response.tracker_url << std::endl;
+	std::cout << "Peer List: " << std::endl;
+	for (const PeerEndpoint& peer : response.peers) {
+		std::cout << peer.to_string() << std::endl;
+	}
+	return response.peers;
+}
@@ -0,0 +1,80 @@
+#ifndef TRACKER_HPP
+#define TRACKER_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bencode.hpp"
+#include "peer_endpoint.hpp"
+
+// values as numbered by BEP 15
+enum class AnnounceEvent { none = 0, completed = 1, started = 2, stopped = 3 };
+
+struct AnnounceRequest {
+	std::string info_hash;	// 20 raw bytes
+	std::string peer_id;
+	std::int64_t port = 6881;
+	std::int64_t uploaded = 0;
+	std::int64_t downloaded = 0;
+	std::int64_t left = 0;
+	AnnounceEvent event = AnnounceEvent::none;
+	std::int64_t numwant = -1;	// -1 leaves it to the tracker
+};
+
+struct AnnounceResponse {
+	bool ok = false;
+	std::string tracker_url;
+	std::string failure_reason;
+	std::int64_t interval = 0;
+	std::int64_t min_interval = 0;
+	std::int64_t seeders = 0;
+	std::int64_t leechers = 0;
+	std::vector<PeerEndpoint> peers;
+};
+
+struct ScrapeResult {
+	std::string info_hash;	// 20 raw bytes
+	bool ok = false;		// the tracker reported on this torrent
+	std::int64_t seeders = 0;
+	std::int64_t completed = 0;
+	std::int64_t leechers = 0;
+};
+
+struct ScrapeResponse {
+	bool ok = false;
+	std::string failure_reason;
+	std::vector<ScrapeResult> files;  // in the order of the info hashes
+};
+
+// Announces over HTTP or, for udp:// URLs, over BEP 15
+AnnounceResponse announce(const std::string& tracker_url,
+						  const AnnounceRequest& request);
+
+AnnounceResponse announce_http(const std::string& tracker_url,
+							   const AnnounceRequest& request);
+
+// Announces to BEP 12 tiers. All trackers of a tier are asked at once and
+// the first good reply is returned right away, merged with the peers of any
+// other tracker that already answered; the next tier is only tried when the
+// whole tier failed. The winner moves to the front of its tier, and the
+// per-tracker success rate is persisted so later runs start with the
+// trackers that tend to answer.
+AnnounceResponse announce_tiers(std::vector<std::vector<std::string>>& tiers,
+								const AnnounceRequest& request);
+
+// Scrape URL by the announce -> scrape convention, empty when the tracker
+// does not support scraping
+std::string get_scrape_url(const std::string& tracker_url);
+
+// Counts for many torrents on one tracker. HTTP puts a batch of info_hash
+// parameters into each scrape request and streams the files dict of the
+// reply through BencodeParser; udp:// URLs use BEP 15 scrape.
+ScrapeResponse scrape_http(const std::string& tracker_url,
+						   const std::vector<std::string>& info_hashes);
+ScrapeResponse scrape(const std::string& tracker_url,
+					  const std::vector<std::string>& info_hashes);
+
+std::vector<PeerEndpoint> get_peer_list(const json& decoded_meta);
+
+#endif	// TRACKER_HPP
@@ -0,0 +1,443 @@
+#include "udp_tracker.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "resolver.hpp"
+
+namespace {
+
+constexpr std::uint64_t PROTOCOL_ID = 0x41727101980;
+constexpr std::uint32_t ACTION_CONNECT = 0;
+constexpr std::uint32_t ACTION_ANNOUNCE = 1;
+constexpr std::uint32_t ACTION_SCRAPE = 2;
+constexpr std::uint32_t ACTION_ERROR = 3;
+// BEP 15: up to about 74 torrents can be scraped at once
+constexpr size_t MAX_SCRAPE_HASHES = 74;
+// BEP 15: a connection ID may be used for one minute after it was received
+constexpr std::chrono::seconds CONNECTION_ID_LIFETIME{60};
+// a DNS lookup that takes longer fails the announce
+constexpr std::int64_t RESOLVE_TIMEOUT_MS = 15000;
+constexpr size_t RECV_BATCH = 64;
+constexpr size_t MAX_PACKET_SIZE = 2048;
+
+using Packet = std::vector<std::uint8_t>;
+
+void put_u16(Packet& packet, std::uint16_t value) {
+	packet.push_back(value >> 8);
+	packet.push_back(value);
+}
+
+void put_u32(Packet& packet, std::uint32_t value) {
+	for (int shift = 24; shift >= 0; shift -= 8) {
+		packet.push_back(value >> shift);
+	}
+}
+
+void put_u64(Packet& packet, std::uint64_t value) {
+	for (int shift = 56; shift >= 0; shift -= 8) {
+		packet.push_back(value >> shift);
+	}
+}
+
+std::uint32_t get_u32(const std::uint8_t* data) {
+	return std::uint32_t(data[0]) << 24 | std::uint32_t(data[1]) << 16 |
+		   std::uint32_t(data[2]) << 8 | std::uint32_t(data[3]);
+}
+
+std::uint64_t get_u64(const std::uint8_t* data) {
+	return std::uint64_t(get_u32(data)) << 32 | get_u32(data + 4);
+}
+
+std::uint32_t random_u32() {
+	thread_local std::mt19937 rng{std::random_device{}()};
+	return rng();
+}
+
+struct CachedConnection {
+	std::uint64_t id;
+	std::chrono::steady_clock::time_point expiry;
+};
+
+// shared by all announcing threads, keyed by "host:port"
+std::mutex connection_cache_mutex;
+std::map<std::string, CachedConnection> connection_cache;
+
+class UdpSocket {
+   public:
+	UdpSocket(const std::string& host, const std::string& port) {
+		ResolvedAddresses addresses =
+			Resolver::instance().resolve(host, port, SOCK_DGRAM,
+										 RESOLVE_TIMEOUT_MS);
+		if (addresses.empty()) {
+			throw std::runtime_error("Failed to resolve " + host);
+		}
+		auto address = addresses.begin();
+		family_ = address->address.ss_family;
+		fd_ = socket(family_, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		// a connected UDP socket only receives from the tracker
+		if (fd_ < 0 ||
+			connect(fd_, reinterpret_cast<const sockaddr*>(&address->address),
+					address->length) < 0) {
+			if (fd_ >= 0) {
+				close(fd_);
+			}
+			throw std::runtime_error("Failed to open UDP socket to " + host);
+		}
+	}
+
+	~UdpSocket() {
+		if (fd_ >= 0) {
+			close(fd_);
+		}
+	}
+
+	UdpSocket(const UdpSocket&) = delete;
+	UdpSocket& operator=(const UdpSocket&) = delete;
+
+	int fd() const { return fd_; }
+	int family() const { return family_; }
+
+   private:
+	int fd_ = -1;
+	int family_ = AF_INET;
+};
+
+// Sends every packet with sendmmsg and retransmits the unanswered ones with
+// BEP 15 backoff. handle_reply gets (packet index, reply); replies for
+// unknown transaction IDs are dropped. Returns false on timeout.
+template <typename Handler>
+bool exchange(int fd, const std::vector<Packet>& packets,
+			  const std::vector<std::uint32_t>& transaction_ids,
+			  const UdpTrackerOptions& options, Handler handle_reply) {
+	std::unordered_map<std::uint32_t, size_t> pending;
+	for (size_t i = 0; i < packets.size(); i++) {
+		pending[transaction_ids[i]] = i;
+	}
+
+	std::vector<std::uint8_t> recv_buffers(RECV_BATCH * MAX_PACKET_SIZE);
+	for (int attempt = 0; attempt <= options.max_retries && !pending.empty();
+		 attempt++) {
+		std::vector<iovec> iovecs;
+		std::vector<mmsghdr> messages;
+		iovecs.reserve(pending.size());
+		for (const auto& [transaction_id, index] : pending) {
+			iovecs.push_back({const_cast<std::uint8_t*>(packets[index].data()),
+							  packets[index].size()});
+		}
+		messages.resize(iovecs.size());
+		for (size_t i = 0; i < iovecs.size(); i++) {
+			messages[i] = {};
+			messages[i].msg_hdr.msg_iov = &iovecs[i];
+			messages[i].msg_hdr.msg_iovlen = 1;
+		}
+		for (size_t sent = 0; sent < messages.size();) {
+			int result = sendmmsg(fd, messages.data() + sent,
+								  messages.size() - sent, 0);
+			if (result < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == EAGAIN) {
+					pollfd pfd{fd, POLLOUT, 0};
+					poll(&pfd, 1, 100);
+					continue;
+				}
+				return false;
+			}
+			sent += result;
+		}
+
+		auto deadline = std::chrono::steady_clock::now() +
+						options.base_timeout * (1 << attempt);
+		while (!pending.empty()) {
+			auto remaining =
+				std::chrono::duration_cast<std::chrono::milliseconds>(
+					deadline - std::chrono::steady_clock::now());
+			if (remaining.count() <= 0) {
+				break;
+			}
+			pollfd pfd{fd, POLLIN, 0};
+			if (poll(&pfd, 1, remaining.count()) <= 0) {
+				continue;
+			}
+
+			std::array<iovec, RECV_BATCH> recv_iovecs;
+			std::array<mmsghdr, RECV_BATCH> recv_messages{};
+			for (size_t i = 0; i < RECV_BATCH; i++) {
+				recv_iovecs[i] = {recv_buffers.data() + i * MAX_PACKET_SIZE,
+								  MAX_PACKET_SIZE};
+				recv_messages[i].msg_hdr.msg_iov = &recv_iovecs[i];
+				recv_messages[i].msg_hdr.msg_iovlen = 1;
+			}
+			int received = recvmmsg(fd, recv_messages.data(), RECV_BATCH,
+									MSG_DONTWAIT, nullptr);
+			for (int i = 0; i < received; i++) {
+				const std::uint8_t* reply =
+					recv_buffers.data() + i * MAX_PACKET_SIZE;
+				size_t length = recv_messages[i].msg_len;
+				if (length < 8) {
+					continue;
+				}
+				auto it = pending.find(get_u32(reply + 4));
+				if (it == pending.end()) {
+					continue;
+				}
+				handle_reply(it->second, reply, length);
+				pending.erase(it);
+			}
+		}
+	}
+	return pending.empty();
+}
+
+std::optional<std::uint64_t> get_connection_id(int fd, const std::string& key,
+											   const UdpTrackerOptions& options,
+											   std::string& error) {
+	{
+		std::lock_guard<std::mutex> lock(connection_cache_mutex);
+		auto it = connection_cache.find(key);
+		if (it != connection_cache.end() &&
+			it->second.expiry > std::chrono::steady_clock::now()) {
+			return it->second.id;
+		}
+	}
+
+	std::uint32_t transaction_id = random_u32();
+	Packet packet;
+	put_u64(packet, PROTOCOL_ID);
+	put_u32(packet, ACTION_CONNECT);
+	put_u32(packet, transaction_id);
+
+	std::optional<std::uint64_t> connection_id;
+	bool answered = exchange(
+		fd, {packet}, {transaction_id}, options,
+		[&](size_t, const std::uint8_t* reply, size_t length) {
+			if (get_u32(reply) == ACTION_CONNECT && length >= 16) {
+				connection_id = get_u64(reply + 8);
+			} else if (get_u32(reply) == ACTION_ERROR) {
+				error.assign(reply + 8, reply + length);
+			}
+		});
+	if (!answered) {
+		error = "UDP tracker timed out";
+	}
+	if (connection_id) {
+		std::lock_guard<std::mutex> lock(connection_cache_mutex);
+		connection_cache[key] = {
+			*connection_id,
+			std::chrono::steady_clock::now() + CONNECTION_ID_LIFETIME};
+	}
+	return connection_id;
+}
+
+// udp://host:port[/announce], authority is "host:port"
+bool parse_udp_url(const std::string& tracker_url, std::string& authority,
+				   std::string& host, std::string& port) {
+	if (!tracker_url.starts_with("udp://")) {
+		return false;
+	}
+	authority = tracker_url.substr(6);
+	authority = authority.substr(0, authority.find('/'));
+	size_t colon_index = authority.rfind(':');
+	if (colon_index == std::string::npos) {
+		return false;
+	}
+	host = authority.substr(0, colon_index);
+	port = authority.substr(colon_index + 1);
+	return true;
+}
+
+}  // namespace
+
+std::vector<AnnounceResponse> announce_udp_batch(
+	const std::string& tracker_url, const std::vector<AnnounceRequest>& requests,
+	const UdpTrackerOptions& options) {
+	std::vector<AnnounceResponse> responses(requests.size());
+	for (AnnounceResponse& response : responses) {
+		response.tracker_url = tracker_url;
+	}
+	auto fail_all = [&](const std::string& reason) {
+		for (AnnounceResponse& response : responses) {
+			response.failure_reason = reason;
+		}
+		return responses;
+	};
+
+	std::string authority, host, port;
+	if (!parse_udp_url(tracker_url, authority, host, port)) {
+		return fail_all("Invalid UDP tracker URL");
+	}
+
+	try {
+		UdpSocket socket(host, port);
+		std::string error;
+		std::optional<std::uint64_t> connection_id =
+			get_connection_id(socket.fd(), authority, options, error);
+		if (!connection_id) {
+			return fail_all(error);
+		}
+
+		std::vector<Packet> packets;
+		std::vector<std::uint32_t> transaction_ids;
+		for (const AnnounceRequest& request : requests) {
+			std::uint32_t transaction_id = random_u32();
+			Packet packet;
+			packet.reserve(98);
+			put_u64(packet, *connection_id);
+			put_u32(packet, ACTION_ANNOUNCE);
+			put_u32(packet, transaction_id);
+			packet.insert(packet.end(), request.info_hash.begin(),
+						  request.info_hash.end());
+			packet.insert(packet.end(), request.peer_id.begin(),
+						  request.peer_id.end());
+			put_u64(packet, request.downloaded);
+			put_u64(packet, request.left);
+			put_u64(packet, request.uploaded);
+			put_u32(packet, static_cast<std::uint32_t>(request.event));
+			put_u32(packet, 0);			   // IP address: sender's
+			put_u32(packet, random_u32());  // key
+			put_u32(packet, request.numwant);
+			put_u16(packet, request.port);
+			packets.push_back(std::move(packet));
+			transaction_ids.push_back(transaction_id);
+		}
+
+		bool expired = false;
+		bool answered = exchange(
+			socket.fd(), packets, transaction_ids, options,
+			[&](size_t index, const std::uint8_t* reply, size_t length) {
+				AnnounceResponse& response = responses[index];
+				std::uint32_t action = get_u32(reply);
+				if (action == ACTION_ANNOUNCE && length >= 20) {
+					response.ok = true;
+					response.interval = get_u32(reply + 8);
+					response.leechers = get_u32(reply + 12);
+					response.seeders = get_u32(reply + 16);
+					// BEP 15: the peer format follows the tracker's family
+					std::string_view peers(
+						reinterpret_cast<const char*>(reply + 20), length - 20);
+					if (socket.family() == AF_INET6) {
+						decode_compact_peers6(peers, response.peers);
+					} else {
+						decode_compact_peers(peers, response.peers);
+					}
+				} else if (action == ACTION_ERROR) {
+					response.failure_reason.assign(reply + 8, reply + length);
+					expired = true;
+				} else {
+					response.failure_reason = "Invalid UDP tracker reply";
+				}
+			});
+		if (expired) {
+			// the tracker may have dropped our connection ID early
+			std::lock_guard<std::mutex> lock(connection_cache_mutex);
+			connection_cache.erase(authority);
+		}
+		if (!answered) {
+			for (AnnounceResponse& response : responses) {
+				if (!response.ok && response.failure_reason.empty()) {
+					response.failure_reason = "UDP tracker timed out";
+				}
+			}
+		}
+	} catch (const std::exception& e) {
+		return fail_all(e.what());
+	}
+	return responses;
+}
+
+AnnounceResponse announce_udp(const std::string& tracker_url,
+							  const AnnounceRequest& request,
+							  const UdpTrackerOptions& options) {
+	return announce_udp_batch(tracker_url, {request}, options).front();
+}
+
+ScrapeResponse scrape_udp(const std::string& tracker_url,
+						  const std::vector<std::string>& info_hashes,
+						  const UdpTrackerOptions& options) {
+	ScrapeResponse response;
+	for (const std::string& info_hash : info_hashes) {
+		response.files.push_back({info_hash});
+	}
+
+	std::string authority, host, port;
+	if (!parse_udp_url(tracker_url, authority, host, port)) {
+		response.failure_reason = "Invalid UDP tracker URL";
+		return response;
+	}
+
+	try {
+		UdpSocket socket(host, port);
+		std::optional<std::uint64_t> connection_id = get_connection_id(
+			socket.fd(), authority, options, response.failure_reason);
+		if (!connection_id) {
+			return response;
+		}
+
+		std::vector<Packet> packets;
+		std::vector<std::uint32_t> transaction_ids;
+		// past the last hash each packet asks about
+		std::vector<size_t> batch_ends;
+		for (size_t first = 0; first < info_hashes.size();
+			 first += MAX_SCRAPE_HASHES) {
+			std::uint32_t transaction_id = random_u32();
+			Packet packet;
+			put_u64(packet, *connection_id);
+			put_u32(packet, ACTION_SCRAPE);
+			put_u32(packet, transaction_id);
+			size_t last = std::min(first + MAX_SCRAPE_HASHES, info_hashes.size());
+			for (size_t i = first; i < last; i++) {
+				packet.insert(packet.end(), info_hashes[i].begin(),
+							  info_hashes[i].end());
+			}
+			packets.push_back(std::move(packet));
+			transaction_ids.push_back(transaction_id);
+			batch_ends.push_back(last);
+		}
+
+		bool answered = exchange(
+			socket.fd(), packets, transaction_ids, options,
+			[&](size_t index, const std::uint8_t* reply, size_t length) {
+				if (get_u32(reply) != ACTION_SCRAPE) {
+					if (get_u32(reply) == ACTION_ERROR) {
+						response.failure_reason.assign(reply + 8,
+													   reply + length);
+					}
+					return;
+				}
+				// seeders, completed, leechers per hash, in request order;
+				// entries past the hashes this packet sent are ignored
+				size_t first = index * MAX_SCRAPE_HASHES;
+				for (size_t offset = 8, i = first;
+					 offset + 12 <= length && i < batch_ends[index];
+					 offset += 12, i++) {
+					ScrapeResult& result = response.files[i];
+					result.ok = true;
+					result.seeders = get_u32(reply + offset);
+					result.completed = get_u32(reply + offset + 4);
+					result.leechers = get_u32(reply + offset + 8);
+				}
+			});
+		response.ok = answered && response.failure_reason.empty();
+		if (!answered && response.failure_reason.empty()) {
+			response.failure_reason = "UDP tracker timed out";
+		}
+	} catch (const std::exception& e) {
+		response.failure_reason = e.what();
+	}
+	return response;
+}
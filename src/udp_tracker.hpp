@@ -0,0 +1,34 @@
+#ifndef UDP_TRACKER_HPP
+#define UDP_TRACKER_HPP
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "tracker.hpp"
+
+struct UdpTrackerOptions {
+	// BEP 15: wait 15 * 2^n seconds before retransmitting, up to n = 8
+	std::chrono::milliseconds base_timeout{15000};
+	int max_retries = 8;
+};
+
+// BEP 15 announce for many torrents on one tracker. Connection IDs are
+// cached per tracker for the minute the spec allows, and all announce
+// packets go out with a single sendmmsg per (re)transmission, replies are
+// drained with recvmmsg. Responses are in the order of requests.
+std::vector<AnnounceResponse> announce_udp_batch(
+	const std::string& tracker_url, const std::vector<AnnounceRequest>& requests,
+	const UdpTrackerOptions& options = {});
+
+AnnounceResponse announce_udp(const std::string& tracker_url,
+							  const AnnounceRequest& request,
+							  const UdpTrackerOptions& options = {});
+
+// BEP 15 scrape, packing as many info hashes into each packet as allowed
+// and sending all packets with one sendmmsg
+ScrapeResponse scrape_udp(const std::string& tracker_url,
+						  const std::vector<std::string>& info_hashes,
+						  const UdpTrackerOptions& options = {});
+
+#endif	// UDP_TRACKER_HPP
@@ -0,0 +1,81 @@
+#include "util.hpp"
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+
+#include "lib/hash/sha1.hpp"
+
+std::string read_file(const std::string& file_path) {
+	std::ifstream file(file_path, std::ios::binary);
+	std::stringstream buffer;
+	if (file) {
+		buffer << file.rdbuf();
+		file.close();
+		return buffer.str();
+	} else {
+		throw std::runtime_error("Failed to open file: " + file_path);
+	}
+}
+
+std::string sha1_hash(const std::string& message) {
+	SHA1 sha1;
+	sha1.update(message);
+	return sha1.final();
+}
+
+std::string sha1_hash(const char* data, size_t size) {
+	SHA1 sha1;
+	sha1.update(data, size);
+	return sha1.final();
+}
+
+std::string hex_string_to_bytes(const std::string& hex_string) {
+	std::string bytes;
+	for (size_t i = 0; i < hex_string.size(); i += 2) {
+		std::string byte_string = hex_string.substr(i, 2);
+		char byte = (char)std::strtol(byte_string.c_str(), nullptr, 16);
+		bytes.push_back(byte);
+	}
+	return bytes;
+}
+
+std::string byte_string_to_hex(const std::string& byte_string) {
+	std::ostringstream hex;
+	for (unsigned char c : byte_string) {
+		hex << std::hex << std::setw(2) << std::setfill('0') << (int)c;
+	}
+	return hex.str();
+}
+
+std::string url_encode(const std::string& input) {
+	std::ostringstream encoded;
+	for (unsigned char c : input) {
+		if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+			encoded << c;
+		} else {
+			encoded << '%' << std::hex << std::setw(2) << std::setfill('0')
+					<< (int)c;
+		}
+	}
+	return encoded.str();
+}
+
+std::string get_cache_dir() {
+	std::filesystem::path dir;
+	if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+		dir = xdg;
+	} else if (const char* home = std::getenv("HOME"); home && *home) {
+		dir = std::filesystem::path(home) / ".cache";
+	} else {
+		dir = std::filesystem::temp_directory_path();
+	}
+	dir /= "bittorrent";
+	std::error_code ec;
+	std::filesystem::create_directories(dir, ec);
+	return dir.string();
+}
@@ -0,0 +1,19 @@
+#ifndef UTIL_HPP
+#define UTIL_HPP
+
+#include <cstddef>
+#include <string>
+
+std::string read_file(const std::string& file_path);
+
+std::string sha1_hash(const std::string& message);
+std::string sha1_hash(const char* data, size_t size);
+std::string hex_string_to_bytes(const std::string& hex_string);
+std::string byte_string_to_hex(const std::string& byte_string);
+std::string url_encode(const std::string& input);
+
+// Directory for state kept between runs (tracker stats, peer cache, ...),
+// $XDG_CACHE_HOME/bittorrent or ~/.cache/bittorrent. Created on demand.
+std::string get_cache_dir();
+
+#endif	// UTIL_HPP
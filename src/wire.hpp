@@ -0,0 +1,104 @@
+#ifndef WIRE_HPP
+#define WIRE_HPP
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Encoding of the fixed-size peer wire messages. Every message has a
+// packed struct whose layout is the wire format, big-endian fields are
+// swapped once when the struct is built, and appending one to an output
+// buffer is a single memcpy. Messages without a payload are compile-time
+// constants.
+namespace wire {
+
+enum MessageId : std::uint8_t {
+	choke = 0,
+	unchoke = 1,
+	interested = 2,
+	not_interested = 3,
+	have = 4,
+	bitfield = 5,
+	request = 6,
+	piece = 7,
+	cancel = 8,
+};
+
+constexpr std::uint32_t to_big_endian(std::uint32_t value) {
+	if constexpr (std::endian::native == std::endian::little) {
+		return std::byteswap(value);
+	} else {
+		return value;
+	}
+}
+
+inline std::uint32_t read_uint32(const char* data) {
+	std::uint32_t value;
+	std::memcpy(&value, data, sizeof(value));
+	return to_big_endian(value);
+}
+
+struct [[gnu::packed]] Header {
+	std::uint32_t length;
+	std::uint8_t id;
+};
+
+struct [[gnu::packed]] HaveMessage {
+	Header header;
+	std::uint32_t piece;
+};
+
+// REQUEST and CANCEL share this layout
+struct [[gnu::packed]] BlockMessage {
+	Header header;
+	std::uint32_t piece;
+	std::uint32_t begin;
+	std::uint32_t length;
+};
+
+static_assert(sizeof(Header) == 5);
+static_assert(sizeof(HaveMessage) == 9);
+static_assert(sizeof(BlockMessage) == 17);
+
+constexpr Header header(MessageId id, std::uint32_t payload_length) {
+	return {to_big_endian(payload_length + 1), id};
+}
+
+constexpr Header simple_message(MessageId id) { return header(id, 0); }
+
+constexpr HaveMessage have_message(std::uint32_t piece) {
+	return {header(have, 4), to_big_endian(piece)};
+}
+
+constexpr BlockMessage block_message(MessageId id, std::uint32_t piece,
+									 std::uint32_t begin,
+									 std::uint32_t length) {
+	return {header(id, 12), to_big_endian(piece), to_big_endian(begin),
+			to_big_endian(length)};
+}
+
+template <typename Message>
+void append(std::vector<char>& out, const Message& message) {
+	const char* bytes = reinterpret_cast<const char*>(&message);
+	out.insert(out.end(), bytes, bytes + sizeof(message));
+}
+
+constexpr size_t HANDSHAKE_LENGTH = 68;
+
+inline void append_handshake(std::vector<char>& out,
+							 const std::string& info_hash,
+							 const std::string& peer_id) {
+	static constexpr std::array<char, 28> prefix = {
+		19,	 'B', 'i', 't', 'T', 'o', 'r', 'r', 'e', 'n',
+		't', ' ', 'p', 'r', 'o', 't', 'o', 'c', 'o', 'l'};
+	out.insert(out.end(), prefix.begin(), prefix.end());
+	out.insert(out.end(), info_hash.begin(), info_hash.end());
+	out.insert(out.end(), peer_id.begin(), peer_id.end());
+}
+
+}  // namespace wire
+
+#endif	// WIRE_HPP